@@ -0,0 +1,295 @@
+/**
+ * @file FlashKVStore.cpp
+ * @author Jeremy Dunne
+ * @brief Implementation of the FlashKVStore
+ * @version 0.1
+ * @date 2022-12-23
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "FlashKVStore.hpp"
+
+FlashStorage_status_t FlashKVStore::init(FlashStorage* storage, unsigned int unit_count){
+    if(unit_count < 2 || unit_count > FLASH_KV_MAX_UNITS) return FLASH_STORAGE_INVALID_CONFIG;
+    _storage = storage;
+    _unit_count = unit_count;
+    _unit_size = _storage->getEraseSize();
+    // take the region off the end of the volume
+    FlashStorage_status_t status = _storage->reserveRegion(_unit_size * _unit_count, &_start_addr);
+    if(status != FLASH_STORAGE_OK) return status;
+    return mount();
+}
+
+FlashStorage_status_t FlashKVStore::initPartition(FlashStorage* storage, unsigned int partition_index){
+    FlashStoragePartition partition;
+    FlashStorage_status_t status = storage->getPartition(partition_index, &partition);
+    if(status != FLASH_STORAGE_OK) return status;
+    if(partition.type != FLASH_STORAGE_PARTITION_KV) return FLASH_STORAGE_INVALID_CONFIG;
+    _storage = storage;
+    _unit_size = _storage->getEraseSize();
+    _unit_count = partition.size / _unit_size;
+    if(_unit_count > FLASH_KV_MAX_UNITS) _unit_count = FLASH_KV_MAX_UNITS;
+    if(_unit_count < 2){
+        _unit_count = 0;
+        return FLASH_STORAGE_INVALID_CONFIG;
+    }
+    _start_addr = partition.start_addr;
+    return mount();
+}
+
+FlashStorage_status_t FlashKVStore::mount(){
+    FlashStorage_status_t status;
+    // clear the index
+    for(unsigned int i = 0; i < FLASH_KV_MAX_KEYS; i ++) _index[i].addr = FLASH_KV_EMPTY_ADDR;
+    _key_count = 0;
+    // find the valid units and the newest one
+    bool found = false;
+    for(unsigned int u = 0; u < _unit_count; u ++){
+        _unit_valid[u] = readHeader(u) == FLASH_STORAGE_OK;
+        if(_unit_valid[u] && (!found || _unit_sequence[u] > _sequence)){
+            found = true;
+            _active = u;
+            _sequence = _unit_sequence[u];
+        }
+    }
+    if(!found) return format();
+    // replay the units oldest first so newer records win
+    unsigned long last = 0;
+    for(unsigned int n = 0; n < _unit_count; n ++){
+        int next = -1;
+        for(unsigned int u = 0; u < _unit_count; u ++){
+            if(!_unit_valid[u]) continue;
+            if(n > 0 && _unit_sequence[u] <= last) continue;
+            if(next < 0 || _unit_sequence[u] < _unit_sequence[next]) next = u;
+        }
+        if(next < 0) break;
+        last = _unit_sequence[next];
+        unsigned long end = replayUnit(next);
+        if((unsigned int)next == _active) _write_addr = end;
+    }
+    // the unit after the active one must be the erased spare
+    unsigned int spare = (_active + 1) % _unit_count;
+    if(_unit_valid[spare]){
+        // an interrupted compaction, finish it
+        status = compactUnit(spare);
+        if(status != FLASH_STORAGE_OK) return status;
+    }
+    else if(!unitErased(spare)){
+        _storage->eraseRaw(unitAddr(spare));
+    }
+    return FLASH_STORAGE_OK;
+}
+
+FlashStorage_status_t FlashKVStore::format(){
+    if(_unit_count == 0) return FLASH_STORAGE_INVALID_CONFIG;
+    for(unsigned int u = 0; u < _unit_count; u ++){
+        _storage->eraseRaw(unitAddr(u));
+        _unit_valid[u] = false;
+    }
+    for(unsigned int i = 0; i < FLASH_KV_MAX_KEYS; i ++) _index[i].addr = FLASH_KV_EMPTY_ADDR;
+    _key_count = 0;
+    _active = 0;
+    _sequence = 1;
+    return writeHeader(_active, _sequence);
+}
+
+FlashStorage_status_t FlashKVStore::set(unsigned int key, byte* buff, unsigned int length){
+    if(_unit_count == 0) return FLASH_STORAGE_INVALID_CONFIG;
+    // a wider key would alias another one once it is read back from flash
+    if(key > FLASH_KV_MAX_KEY) return FLASH_STORAGE_INVALID_CONFIG;
+    if(length > FLASH_KV_MAX_VALUE_SIZE) return FLASH_STORAGE_NO_SPACE;
+    int slot = findSlot(key);
+    if(slot < 0) return FLASH_STORAGE_NO_SPACE;
+    // rotate until the record fits, compaction always leaves room for one more
+    FlashStorage_status_t status = appendRecord(key, buff, length);
+    for(unsigned int n = 0; n < _unit_count && status == FLASH_STORAGE_NO_SPACE; n ++){
+        status = rotate();
+        if(status != FLASH_STORAGE_OK) return status;
+        status = appendRecord(key, buff, length);
+    }
+    return status;
+}
+
+FlashStorage_status_t FlashKVStore::get(unsigned int key, byte* buff, unsigned int* length){
+    if(_unit_count == 0) return FLASH_STORAGE_INVALID_CONFIG;
+    if(key > FLASH_KV_MAX_KEY) return FLASH_STORAGE_INVALID_CONFIG;
+    int slot = findSlot(key);
+    if(slot < 0 || _index[slot].addr == FLASH_KV_EMPTY_ADDR) return FLASH_STORAGE_NOT_FOUND;
+    // read the whole record to check it
+    byte record[FLASH_KV_RECORD_OVERHEAD + FLASH_KV_MAX_VALUE_SIZE];
+    FlashStorage_status_t status = _storage->readRaw(_index[slot].addr, record, 4);
+    if(status != FLASH_STORAGE_OK) return status;
+    unsigned int value_length = record[3];
+    if(value_length > FLASH_KV_MAX_VALUE_SIZE) return FLASH_STORAGE_FLASH_FAIL;
+    status = _storage->readRaw(_index[slot].addr + 4, &record[4], value_length + 2);
+    if(status != FLASH_STORAGE_OK) return status;
+    unsigned int crc = (unsigned int)record[4 + value_length] << 8 | record[5 + value_length];
+    if(crc != _storage->crc16(record, 4 + value_length)) return FLASH_STORAGE_FLASH_FAIL;
+    if(value_length > *length) value_length = *length;
+    memcpy(buff, &record[4], value_length);
+    *length = record[3];
+    return FLASH_STORAGE_OK;
+}
+
+unsigned int FlashKVStore::count(){
+    return _key_count;
+}
+
+int FlashKVStore::findSlot(unsigned int key){
+    // open addressing with linear probing, keys are never removed
+    unsigned int slot = (key * 40503u) & (FLASH_KV_MAX_KEYS - 1);
+    for(unsigned int n = 0; n < FLASH_KV_MAX_KEYS; n ++){
+        if(_index[slot].addr == FLASH_KV_EMPTY_ADDR || _index[slot].key == key) return slot;
+        slot = (slot + 1) & (FLASH_KV_MAX_KEYS - 1);
+    }
+    return -1;
+}
+
+FlashStorage_status_t FlashKVStore::readHeader(unsigned int unit){
+    byte header[FLASH_KV_UNIT_HEADER_SIZE];
+    FlashStorage_status_t status = _storage->readRaw(unitAddr(unit), header, FLASH_KV_UNIT_HEADER_SIZE);
+    if(status != FLASH_STORAGE_OK) return status;
+    if(header[0] != FLASH_KV_UNIT_MAGIC_0 || header[1] != FLASH_KV_UNIT_MAGIC_1) return FLASH_STORAGE_NOT_FOUND;
+    unsigned int crc = (unsigned int)header[6] << 8 | header[7];
+    if(crc != _storage->crc16(header, 6)) return FLASH_STORAGE_NOT_FOUND;
+    _unit_sequence[unit] = (unsigned long)header[2] << 24 | (unsigned long)header[3] << 16 | (unsigned long)header[4] << 8 | header[5];
+    return FLASH_STORAGE_OK;
+}
+
+FlashStorage_status_t FlashKVStore::writeHeader(unsigned int unit, unsigned long sequence){
+    byte header[FLASH_KV_UNIT_HEADER_SIZE];
+    header[0] = FLASH_KV_UNIT_MAGIC_0;
+    header[1] = FLASH_KV_UNIT_MAGIC_1;
+    header[2] = sequence >> 24;
+    header[3] = sequence >> 16;
+    header[4] = sequence >> 8;
+    header[5] = sequence;
+    unsigned int crc = _storage->crc16(header, 6);
+    header[6] = crc >> 8;
+    header[7] = crc;
+    FlashStorage_status_t status = _storage->programRaw(unitAddr(unit), header, FLASH_KV_UNIT_HEADER_SIZE);
+    if(status != FLASH_STORAGE_OK) return status;
+    _unit_valid[unit] = true;
+    _unit_sequence[unit] = sequence;
+    _write_addr = unitAddr(unit) + FLASH_KV_UNIT_HEADER_SIZE;
+    return FLASH_STORAGE_OK;
+}
+
+unsigned long FlashKVStore::replayUnit(unsigned int unit){
+    unsigned long addr = unitAddr(unit) + FLASH_KV_UNIT_HEADER_SIZE;
+    unsigned long end = unitAddr(unit) + _unit_size;
+    byte record[FLASH_KV_RECORD_OVERHEAD + FLASH_KV_MAX_VALUE_SIZE];
+    while(addr < end){
+        if(_storage->readRaw(addr, record, 1) != FLASH_STORAGE_OK) return end;
+        if(record[0] == 0xFF){
+            // either the end of the log or padding up to the next page
+            unsigned long next_page = (addr / FLASH_STORAGE_PAGE_SIZE + 1) * FLASH_STORAGE_PAGE_SIZE;
+            if(next_page >= end) return addr;
+            _storage->readRaw(next_page, record, 1);
+            if(record[0] != FLASH_KV_RECORD_MARKER) return addr;
+            addr = next_page;
+            continue;
+        }
+        if(record[0] != FLASH_KV_RECORD_MARKER) return end;
+        _storage->readRaw(addr, record, 4);
+        unsigned int length = record[3];
+        if(length > FLASH_KV_MAX_VALUE_SIZE) return end;
+        _storage->readRaw(addr + 4, &record[4], length + 2);
+        unsigned int crc = (unsigned int)record[4 + length] << 8 | record[5 + length];
+        if(crc != _storage->crc16(record, 4 + length)){
+            // torn record, don't append after it
+            return end;
+        }
+        unsigned int key = (unsigned int)record[1] << 8 | record[2];
+        int slot = findSlot(key);
+        if(slot >= 0){
+            if(_index[slot].addr == FLASH_KV_EMPTY_ADDR) _key_count ++;
+            _index[slot].key = key;
+            _index[slot].addr = addr;
+        }
+        addr += FLASH_KV_RECORD_OVERHEAD + length;
+    }
+    return end;
+}
+
+FlashStorage_status_t FlashKVStore::appendRecord(unsigned int key, byte* buff, unsigned int length){
+    unsigned int size = FLASH_KV_RECORD_OVERHEAD + length;
+    unsigned long addr = recordAddr(size);
+    if(addr + size > unitAddr(_active) + _unit_size) return FLASH_STORAGE_NO_SPACE;
+    int slot = findSlot(key);
+    if(slot < 0) return FLASH_STORAGE_NO_SPACE;
+    // build the record
+    byte record[FLASH_KV_RECORD_OVERHEAD + FLASH_KV_MAX_VALUE_SIZE];
+    record[0] = FLASH_KV_RECORD_MARKER;
+    record[1] = key >> 8;
+    record[2] = key;
+    record[3] = length;
+    memcpy(&record[4], buff, length);
+    unsigned int crc = _storage->crc16(record, 4 + length);
+    record[4 + length] = crc >> 8;
+    record[5 + length] = crc;
+    // a single page program
+    FlashStorage_status_t status = _storage->programRaw(addr, record, size);
+    if(status != FLASH_STORAGE_OK) return status;
+    _write_addr = addr + size;
+    if(_index[slot].addr == FLASH_KV_EMPTY_ADDR) _key_count ++;
+    _index[slot].key = key;
+    _index[slot].addr = addr;
+    return FLASH_STORAGE_OK;
+}
+
+FlashStorage_status_t FlashKVStore::rotate(){
+    // the spare becomes active
+    unsigned int next = (_active + 1) % _unit_count;
+    _active = next;
+    _sequence ++;
+    FlashStorage_status_t status = writeHeader(_active, _sequence);
+    if(status != FLASH_STORAGE_OK) return status;
+    // the unit after it is the oldest, move its live records over and erase it to make the new spare
+    unsigned int victim = (_active + 1) % _unit_count;
+    if(_unit_valid[victim]) return compactUnit(victim);
+    return FLASH_STORAGE_OK;
+}
+
+FlashStorage_status_t FlashKVStore::compactUnit(unsigned int unit){
+    unsigned long start = unitAddr(unit);
+    byte value[FLASH_KV_MAX_VALUE_SIZE];
+    for(unsigned int i = 0; i < FLASH_KV_MAX_KEYS; i ++){
+        if(_index[i].addr == FLASH_KV_EMPTY_ADDR) continue;
+        if(_index[i].addr < start || _index[i].addr >= start + _unit_size) continue;
+        // still live in this unit, copy it
+        unsigned int length = sizeof(value);
+        FlashStorage_status_t status = get(_index[i].key, value, &length);
+        if(status != FLASH_STORAGE_OK) continue;
+        status = appendRecord(_index[i].key, value, length);
+        if(status != FLASH_STORAGE_OK) return status;
+    }
+    _storage->eraseRaw(start);
+    _unit_valid[unit] = false;
+    return FLASH_STORAGE_OK;
+}
+
+bool FlashKVStore::unitErased(unsigned int unit){
+    byte buff[32];
+    unsigned long addr = unitAddr(unit);
+    for(unsigned long offset = 0; offset < _unit_size; offset += sizeof(buff)){
+        if(_storage->readRaw(addr + offset, buff, sizeof(buff)) != FLASH_STORAGE_OK) return false;
+        for(unsigned int i = 0; i < sizeof(buff); i ++){
+            if(buff[i] != 0xFF) return false;
+        }
+    }
+    return true;
+}
+
+unsigned long FlashKVStore::recordAddr(unsigned int size){
+    // move to the next page if the record would cross this one
+    unsigned long page_remaining = FLASH_STORAGE_PAGE_SIZE - _write_addr % FLASH_STORAGE_PAGE_SIZE;
+    if(size > page_remaining) return _write_addr + page_remaining;
+    return _write_addr;
+}
+
+unsigned long FlashKVStore::unitAddr(unsigned int unit){
+    return _start_addr + unit * _unit_size;
+}
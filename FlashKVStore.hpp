@@ -0,0 +1,217 @@
+/**
+ * @file FlashKVStore.hpp
+ * @author Jeremy Dunne
+ * @brief Flash Key Value Store header file
+ * @version 0.1
+ * @date 2022-12-23
+ *
+ * Log structured key value store for parameters and counters. Lives in a KV partition or a region reserved at the end of
+ * a FlashStorage volume and uses its device layer directly, so an update is a single page program with no FAT write.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_KV_STORE_HPP_
+#define _FLASH_KV_STORE_HPP_
+
+// includes
+#include <Arduino.h>
+#include "FlashStorage.hpp"
+
+// pre-definitions
+#define FLASH_KV_MAX_KEYS 64 // must be a power of 2
+#define FLASH_KV_MAX_VALUE_SIZE 32
+#define FLASH_KV_MAX_KEY 0xFFFF // keys are stored in 2 bytes
+#define FLASH_KV_MAX_UNITS 8
+#define FLASH_KV_UNIT_MAGIC_0 'K'
+#define FLASH_KV_UNIT_MAGIC_1 'V'
+#define FLASH_KV_UNIT_HEADER_SIZE 8 // 2 byte magic, 4 byte sequence, 2 byte crc
+#define FLASH_KV_RECORD_MARKER 0x5A
+#define FLASH_KV_RECORD_OVERHEAD 6 // marker, 2 byte key, length, 2 byte crc
+#define FLASH_KV_EMPTY_ADDR 0xFFFFFFFF
+
+/*
+    KV store implementation notes:
+        The region is split into erase units (at least 2). Each unit in use starts with a header:
+            'K' 'V', 4 byte sequence number, 2 byte CRC-16 of the first 6 bytes.
+        Records follow the header and are appended in order:
+            FLASH_KV_RECORD_MARKER, 2 byte key, 1 byte length, value, 2 byte CRC-16 of everything before it.
+            A record never crosses a page, so an update is exactly one page program.
+            The first 0xFF marker ends the log of a unit. A record with a bad CRC closes the unit for further appends.
+        The unit after the active (highest sequence) unit is always kept erased as the spare. When the active unit is full
+            the spare becomes active, the live records of the unit after it (the oldest) are copied over and that unit is
+            erased to become the new spare. With 2 units the old active unit is the one compacted.
+        At init the units are replayed in sequence order into a RAM hash index (key -> record address), so lookups are O(1).
+            A spare that still holds a valid header is the victim of an interrupted compaction, it is finished before use.
+        FLASH_KV_MAX_KEYS * (FLASH_KV_RECORD_OVERHEAD + FLASH_KV_MAX_VALUE_SIZE) plus page padding must fit in one unit so a
+            compaction always succeeds.
+*/
+struct FlashKVEntry{
+    unsigned int key;
+    unsigned long addr; // address of the latest record, FLASH_KV_EMPTY_ADDR if the slot is unused
+};
+
+class FlashKVStore{
+public:
+
+    /**
+     * @brief initialize the key value store
+     *
+     * Reserves unit_count erase units at the end of the storage volume, rebuilds the index from them and finishes any
+     * interrupted compaction. A region without any valid unit is formatted.
+     *
+     * @param storage initialized FlashStorage to build on
+     * @param unit_count number of erase units to use (2 to FLASH_KV_MAX_UNITS)
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t init(FlashStorage* storage, unsigned int unit_count);
+
+    /**
+     * @brief initialize the key value store on a KV partition
+     *
+     * Uses every erase unit of the partition (up to FLASH_KV_MAX_UNITS), otherwise the same as init().
+     *
+     * @param storage initialized FlashStorage with a partition table
+     * @param partition_index index of a FLASH_STORAGE_PARTITION_KV partition
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t initPartition(FlashStorage* storage, unsigned int partition_index);
+
+    /**
+     * @brief erase every unit and start an empty store
+     *
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t format();
+
+    /**
+     * @brief store a value
+     *
+     * Appends a record to the active unit, rotating and compacting when it is full.
+     *
+     * @param key key to store under (up to FLASH_KV_MAX_KEY)
+     * @param buff value to store
+     * @param length length of the value (up to FLASH_KV_MAX_VALUE_SIZE)
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if the key is out of range
+     */
+    FlashStorage_status_t set(unsigned int key, byte* buff, unsigned int length);
+
+    /**
+     * @brief read a value
+     *
+     * @param key key to look up (up to FLASH_KV_MAX_KEY)
+     * @param buff buffer to read the value into
+     * @param length size of buff, set to the length of the value
+     * @return FlashStorage_status_t FLASH_STORAGE_NOT_FOUND if the key was never set, FLASH_STORAGE_INVALID_CONFIG if it is
+     * out of range
+     */
+    FlashStorage_status_t get(unsigned int key, byte* buff, unsigned int* length);
+
+    /**
+     * @brief get the number of keys stored
+     *
+     * @return unsigned int number of keys
+     */
+    unsigned int count();
+
+private:
+    FlashStorage* _storage;
+    unsigned long _start_addr;
+    unsigned long _unit_size;
+    unsigned int _unit_count = 0;
+
+    unsigned int _active; // unit currently appended to
+    unsigned long _sequence; // sequence of the active unit
+    unsigned long _write_addr; // next free address in the active unit
+    bool _unit_valid[FLASH_KV_MAX_UNITS];
+    unsigned long _unit_sequence[FLASH_KV_MAX_UNITS];
+
+    FlashKVEntry _index[FLASH_KV_MAX_KEYS];
+    unsigned int _key_count = 0;
+
+    /**
+     * @brief find the index slot for a key
+     *
+     * @param key key to look for
+     * @return int slot holding the key, or the empty slot it would go in, -1 if the index is full
+     */
+    int findSlot(unsigned int key);
+
+    /**
+     * @brief rebuild the index from the region and finish any interrupted compaction
+     *
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t mount();
+
+    /**
+     * @brief read and check a unit header
+     *
+     * @param unit unit to check
+     * @return FlashStorage_status_t FLASH_STORAGE_OK if the header is valid, _unit_sequence is updated
+     */
+    FlashStorage_status_t readHeader(unsigned int unit);
+
+    /**
+     * @brief start a unit by writing its header
+     *
+     * @param unit erased unit to start
+     * @param sequence sequence number to give it
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t writeHeader(unsigned int unit, unsigned long sequence);
+
+    /**
+     * @brief replay the records of a unit into the index
+     *
+     * @param unit unit to replay
+     * @return unsigned long address after the last valid record
+     */
+    unsigned long replayUnit(unsigned int unit);
+
+    /**
+     * @brief append a record to the active unit and point the index at it
+     *
+     * @param key key of the record
+     * @param buff value
+     * @param length length of the value
+     * @return FlashStorage_status_t FLASH_STORAGE_NO_SPACE if the active unit is full
+     */
+    FlashStorage_status_t appendRecord(unsigned int key, byte* buff, unsigned int length);
+
+    /**
+     * @brief make the spare unit active and compact the oldest unit into it
+     *
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t rotate();
+
+    /**
+     * @brief copy the live records of a unit into the active unit, then erase it
+     *
+     * @param unit unit to compact
+     * @return FlashStorage_status_t
+     */
+    FlashStorage_status_t compactUnit(unsigned int unit);
+
+    /**
+     * @brief check that a unit reads back as erased
+     *
+     * @param unit unit to check
+     * @return true if every byte is 0xFF
+     */
+    bool unitErased(unsigned int unit);
+
+    /**
+     * @brief get the aligned address a record of the given size would be written at
+     *
+     * @param size size of the record
+     * @return unsigned long address, records never cross a page
+     */
+    unsigned long recordAddr(unsigned int size);
+
+    unsigned long unitAddr(unsigned int unit);
+};
+
+#endif
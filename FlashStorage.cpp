@@ -11,13 +11,132 @@
 
 #include "FlashStorage.hpp"
 
+// sketches built with other FlashStorageConfig.hpp sizes reference a symbol that does not exist and fail to link 
+const unsigned char FLASH_STORAGE_CONFIG_SIGNATURE = 0; 
+
 FlashStorage_status_t FlashStorage::init(int cs_pin){
-    // initialize the W25Q64 
-    _flash_status = _flash.init(cs_pin); 
-    if(_flash_status != W25Q64_OK){
-        // assume a complete failure for now 
-        return FLASH_STORAGE_FLASH_FAIL; 
+    // a single chip is just an array of one 
+    return init(&cs_pin, 1, FLASH_STORAGE_ARRAY_SINGLE); 
+}
+
+FlashStorage_status_t FlashStorage::init(int* cs_pins, unsigned int device_count, FlashStorageArrayMode array_mode, unsigned long* device_sizes){
+    // constructed with the library's sizes 
+    if(_config != &FLASH_STORAGE_CONFIG_SIGNATURE) return FLASH_STORAGE_INVALID_CONFIG; 
+    // check the array configuration 
+    if(device_count == 0 || device_count > FLASH_STORAGE_MAX_DEVICES) return FLASH_STORAGE_INVALID_CONFIG; 
+    if(array_mode == FLASH_STORAGE_ARRAY_SINGLE && device_count != 1) return FLASH_STORAGE_INVALID_CONFIG; 
+    if(array_mode == FLASH_STORAGE_ARRAY_PING_PONG && device_count < 2) return FLASH_STORAGE_INVALID_CONFIG; 
+    _device_count = device_count; 
+    _array_mode = array_mode; 
+    _lookahead_erase_size = FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE; 
+    // record the device sizes, find the smallest 
+    unsigned long min_size = FLASH_STORAGE_MAX_DEVICE_SIZE; 
+    unsigned long total_size = 0; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        _device_size[d] = (device_sizes == NULL) ? FLASH_STORAGE_DEVICE_SIZE : device_sizes[d]; 
+        if(_device_size[d] == 0 || _device_size[d] > FLASH_STORAGE_MAX_DEVICE_SIZE) return FLASH_STORAGE_INVALID_CONFIG; 
+        if(_device_size[d] % FLASH_STORAGE_SECTOR_SIZE != 0) return FLASH_STORAGE_INVALID_CONFIG; 
+        // ping pong regions can't straddle the end of a device 
+        if(_array_mode == FLASH_STORAGE_ARRAY_PING_PONG && _device_size[d] % FLASH_STORAGE_PING_PONG_REGION_SIZE != 0) return FLASH_STORAGE_INVALID_CONFIG; 
+        if(_device_size[d] < min_size) min_size = _device_size[d]; 
+        total_size += _device_size[d]; 
+    }
+    if(_array_mode == FLASH_STORAGE_ARRAY_PING_PONG){
+        // whole regions alternate, erase a full region ahead on the other chip 
+        _stripe_size = FLASH_STORAGE_PING_PONG_REGION_SIZE; 
+        _erase_size = FLASH_STORAGE_SECTOR_SIZE; 
+        _lookahead_erase_size = FLASH_STORAGE_PING_PONG_REGION_SIZE; 
+    }
+    else if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED){
+        // every device holds the same sector 
+        _stripe_size = min_size; 
+        _erase_size = FLASH_STORAGE_SECTOR_SIZE; 
+    }
+    else if(_array_mode == FLASH_STORAGE_ARRAY_CONCATENATED){
+        // devices follow each other, the unit is a sector on one device 
+        _stripe_size = min_size; 
+        _erase_size = FLASH_STORAGE_SECTOR_SIZE; 
+    }
+    else{
+        // pages are striped, the erase unit covers one sector on every device 
+        _stripe_size = FLASH_STORAGE_PAGE_SIZE; 
+        _erase_size = (unsigned long)FLASH_STORAGE_SECTOR_SIZE * _device_count; 
+    }
+    // only concatenated arrays use each device in full 
+    if(_array_mode != FLASH_STORAGE_ARRAY_CONCATENATED){
+        for(unsigned int d = 0; d < _device_count; d ++) _device_size[d] = min_size; 
+    }
+    _min_lookahead = _lookahead_erase_size; 
+    _capacity = min_size * _device_count; 
+    if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED) _capacity = min_size; 
+    if(_array_mode == FLASH_STORAGE_ARRAY_CONCATENATED) _capacity = total_size; 
+#if FLASH_STORAGE_WRITE_STATS 
+    // write statistics start again with setWriteStats() 
+    _write_stats = false; 
+    _stats_bytes = 0; 
+    _stats_max = 0; 
+    for(unsigned int b = 0; b < FLASH_STORAGE_LATENCY_BUCKETS; b ++) _latency_histogram[b] = 0; 
+#endif 
+#if FLASH_STORAGE_POWER_SAVING 
+    // devices left in deep power-down don't answer 
+    _asleep = false; 
+    _power_saving = false; 
+    _wake_count = 0; 
+    _wake_latency = 0; 
+    _awake_time = 0; 
+    if(_power_callback != NULL){
+        for(unsigned int d = 0; d < _device_count; d ++) _power_callback(d, true, _power_context); 
+        sleepMicros(_wake_time); 
+    }
+#endif 
+    // initialize the W25Q64s 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        _flash_status = _flash[d].init(cs_pins[d]); 
+        if(_flash_status != W25Q64_OK){
+            // assume a complete failure for now 
+            return FLASH_STORAGE_FLASH_FAIL; 
+        }
     }
+    // nothing is known about operations started before init, poll those 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        _op_type[d] = FLASH_STORAGE_OP_NONE; 
+        _program_time[d] = FLASH_STORAGE_PROGRAM_TIME_US; 
+        _erase_time[d] = FLASH_STORAGE_ERASE_TIME_US; 
+    }
+#if FLASH_STORAGE_CLOCK_CALIBRATION 
+    for(unsigned int d = 0; d < _device_count; d ++) _clock_rate[d] = 0; 
+    _clock_calibrated = false; 
+#endif 
+    _status_reads = 0; 
+    _mirror_mismatches = 0; 
+    // wait for any previous operation to finish 
+    waitForDevices(); 
+    // without a partition table the file area is the whole volume 
+    _fat_addr = 0; 
+    _area_limit = _capacity; 
+    _area_end = _capacity; 
+    _area_reserved = 0; 
+    _files_mounted = true; 
+#if FLASH_STORAGE_PARTITIONS 
+    _partition_count = 0; 
+    if(readPartitionTable() == FLASH_STORAGE_OK){
+        // mount the first file partition 
+        for(unsigned int p = 0; p < _partition_count; p ++){
+            if(_partitions[p].type == FLASH_STORAGE_PARTITION_FILES) return mountPartition(p); 
+        }
+        // unit 0 holds the partition table, there is no file area to format 
+        _files_mounted = false; 
+        _fat.file_count = 0; 
+        return FLASH_STORAGE_NO_FAT_FOUND; 
+    }
+#else 
+    if(readPartitionTable() == FLASH_STORAGE_OK){
+        // a partitioned volume, formatting it as a whole would wipe the table 
+        _files_mounted = false; 
+        _fat.file_count = 0; 
+        return FLASH_STORAGE_INVALID_CONFIG; 
+    }
+#endif 
     // check for a FAT table 
     _status = readFAT();
     // report that status 
@@ -25,11 +144,23 @@ FlashStorage_status_t FlashStorage::init(int cs_pin){
 }
 
 FlashStorage_status_t FlashStorage::initializeFAT(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_INITIALIZE_FAT, 0); 
     // create a new FAT table 
     // can also be used to erase a previous FAT 
+    if(!_files_mounted) return FLASH_STORAGE_WRONG_MODE; 
     // allow this to be blocking 
-    while(_flash.busy()); 
+    waitForDevices(); 
     _fat.file_count = 0; 
+    // only the regions reserved since init() are kept 
+    _area_end = _area_limit - _area_reserved; 
+    // files are gone, switch to alternating units if the area has room 
+    _fat_units = (_fat_addr + (FLASH_STORAGE_FAT_UNITS + 1)*_erase_size <= _area_end) ? FLASH_STORAGE_FAT_UNITS : 1; 
+    _fat_active = _fat_units - 1; 
+    // an old table left in the second unit must not win over the new one 
+    if(_fat_units > 1){
+        eraseUnit(_fat_addr + _erase_size); 
+        waitForDevices(); 
+    }
     return writeFAT();
 }
 
@@ -40,32 +171,49 @@ FlashStorage_status_t FlashStorage::getFAT(FlashStorageFAT* fat){
 }
 
 FlashStorage_status_t FlashStorage::newFile(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_NEW_FILE, 0); 
+    if(!_files_mounted) return FLASH_STORAGE_WRONG_MODE; 
     // check and close if a file is open 
     close(); 
     // add a new file to the _fat table 
     if(_fat.file_count + 1 < FLASH_STORAGE_MAX_FILE_NUMBER){
         // determine the new start address 
-        unsigned long new_addr = 1<<12; 
-        if(_fat.file_count != 0){
-            new_addr = ((_fat.files[ _fat.file_count-1].end_addr >> 12) + 1) << 12; // new sector  
+        unsigned long new_addr = _fat_addr + _fat_units*_erase_size; 
+        bool erased = false; 
+        // inline files don't occupy the data region 
+        int last = _fat.file_count - 1; 
+        while(last >= 0 && _fat.files[last].is_inline) last --; 
+        if(last >= 0){
+            // pack onto the next page, the tail of the last erase unit is usable if it was never written 
+            unsigned long end_addr = _fat.files[last].end_addr; 
+            new_addr = (end_addr + FLASH_STORAGE_PAGE_SIZE - 1) / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; 
+            unsigned long unit_end = (new_addr / _erase_size + 1) * _erase_size; 
+            if(new_addr % _erase_size != 0 && isErased(new_addr, unit_end - new_addr)){
+                erased = true; 
+            }
+            else{
+                new_addr = (end_addr + _erase_size - 1) / _erase_size * _erase_size; // new erase unit  
+            }
         }
+        if(new_addr >= _area_end) return FLASH_STORAGE_NO_SPACE; 
+        _status = acquireBuffer(); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
         // add the new file to the FAT 
         _fat.file_count ++;
         _fat.files[_fat.file_count-1].start_addr = new_addr; 
         _fat.files[_fat.file_count-1].end_addr =  new_addr; 
+        _fat.files[_fat.file_count-1].is_inline = false; 
         // set the opened file indicator 
         _opened_file = _fat.file_count; 
         // set the mode 
         _mode = FLASH_STORAGE_WRITE_MODE; 
-        // go ahead and start an erase at this location 
-        while(_flash.busy()); 
-        _flash.writeEnable(); 
-        _flash.sectorErase(new_addr); 
         // update the pointers 
         _curr_addr = new_addr; 
-        _max_erased_addr = _curr_addr + 4096; 
+        _max_erased_addr = (new_addr / _erase_size + 1) * _erase_size; 
+        // go ahead and start an erase at this location if needed 
+        if(!erased) eraseUnit(new_addr); 
         // wait and write this  
-        while(_flash.busy()); 
+        waitForDevices(); 
         return writeFAT(); 
     }
     else{
@@ -73,11 +221,82 @@ FlashStorage_status_t FlashStorage::newFile(){
     }
 }
 
+FlashStorage_status_t FlashStorage::newFile(unsigned long size_hint){
+    _status = newFile(); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    return reserve(size_hint, true); 
+}
+
+FlashStorage_status_t FlashStorage::reserve(unsigned long bytes, bool blocking){
+    TraceScope trace(this, blocking ? FLASH_STORAGE_TRACE_RESERVE : FLASH_STORAGE_TRACE_RESERVE_BACKGROUND, bytes); 
+    if(_mode != FLASH_STORAGE_WRITE_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    // round up to whole erase units 
+    unsigned long target = (_curr_addr + _buff_index + bytes + _erase_size - 1) / _erase_size * _erase_size; 
+    if(target > _area_end) return FLASH_STORAGE_NO_SPACE; 
+    if(target > _reserve_addr) _reserve_addr = target; 
+    if(!blocking) return FLASH_STORAGE_OK; 
+    // start every erase, eraseUnit only waits on the devices it needs so units on different chips overlap 
+    while(_max_erased_addr < _reserve_addr){
+        eraseUnit(_max_erased_addr); 
+        _max_erased_addr += _erase_size; 
+    }
+    waitForDevices(); 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::poll(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_POLL, 0); 
+    if(_mode != FLASH_STORAGE_WRITE_MODE) return FLASH_STORAGE_OK; 
+    // start the next erase if its devices are free 
+    if(_max_erased_addr < _reserve_addr) eraseNextSector(); 
+    // done once the last erase has finished too 
+    if(_max_erased_addr >= _reserve_addr && !busy()) return FLASH_STORAGE_OK; 
+    return FLASH_STORAGE_BUSY; 
+}
+
+unsigned long FlashStorage::getReserveRemaining(){
+    if(_mode != FLASH_STORAGE_WRITE_MODE || _max_erased_addr >= _reserve_addr) return 0; 
+    return _reserve_addr - _max_erased_addr; 
+}
+
+unsigned long FlashStorage::getLookaheadRemaining(){
+    if(_mode != FLASH_STORAGE_WRITE_MODE || !lookaheadNeeded()) return 0; 
+    unsigned long end = _curr_addr + _buff_index + FLASH_STORAGE_PAGE_SIZE + _lookahead_erase_size; 
+    if(end > _area_end) end = _area_end; 
+    if(end <= _max_erased_addr) return 0; 
+    return end - _max_erased_addr; 
+}
+
+FlashStorage_status_t FlashStorage::writeFile(byte* buff, unsigned int length){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_WRITE_FILE, length); 
+    // check and close if a file is open 
+    close(); 
+    unsigned int used = inlineUsed(); 
+    if(length > FLASH_STORAGE_INLINE_MAX_SIZE || used + length > FLASH_STORAGE_INLINE_POOL_SIZE){
+        // too big to keep inline, store it as a regular file 
+        _status = newFile(); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
+        _status = write(buff, length); 
+        close(); 
+        return _status; 
+    }
+    if(_fat.file_count + 1 >= FLASH_STORAGE_MAX_FILE_NUMBER) return FLASH_STORAGE_NO_SPACE; 
+    // append to the inline pool and commit with a single FAT write 
+    memcpy(&_fat.inline_data[used], buff, length); 
+    _fat.file_count ++; 
+    _fat.files[_fat.file_count-1].start_addr = used; 
+    _fat.files[_fat.file_count-1].end_addr = used + length; 
+    _fat.files[_fat.file_count-1].is_inline = true; 
+    waitForDevices(); 
+    return writeFAT(); 
+}
+
 FlashStorage_status_t FlashStorage::openFile(unsigned int file_index){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_OPEN_FILE, file_index); 
     // check and close if a file is open 
     close(); 
     // check that the file index is valid 
-    if(file_index > _fat.file_count){
+    if(file_index == 0 || file_index > _fat.file_count){
         return FLASH_STORAGE_INVALID_FILE; 
     }
     // go ahead and update pointers 
@@ -85,77 +304,197 @@ FlashStorage_status_t FlashStorage::openFile(unsigned int file_index){
     _curr_addr = _fat.files[_opened_file-1].start_addr; 
     _mode = FLASH_STORAGE_READ_MODE; 
     // wait until free 
-    while(_flash.busy()); 
+    waitForDevices(); 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::openForAppend(unsigned int file_index){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_OPEN_FOR_APPEND, file_index); 
+    // check and close if a file is open 
+    close(); 
+    // check that the file index is valid 
+    if(file_index == 0 || file_index > _fat.file_count || _fat.files[file_index-1].is_inline){
+        return FLASH_STORAGE_INVALID_FILE; 
+    }
+    // no data file may follow it 
+    for(unsigned int i = file_index; i < _fat.file_count; i ++){
+        if(!_fat.files[i].is_inline) return FLASH_STORAGE_INVALID_FILE; 
+    }
+    // everything after the end of the file in its erase unit has to be blank 
+    unsigned long end_addr = _fat.files[file_index-1].end_addr; 
+    unsigned long unit_end = (end_addr + _erase_size - 1) / _erase_size * _erase_size; 
+    if(!isErased(end_addr, unit_end - end_addr)) return FLASH_STORAGE_INVALID_FILE; 
+    _status = acquireBuffer(); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    // go ahead and update pointers 
+    _opened_file = file_index; 
+    _curr_addr = end_addr; 
+    _max_erased_addr = unit_end; 
+    _mode = FLASH_STORAGE_WRITE_MODE; 
+    // record the file as in progress and keep erasing ahead 
+    _status = writeFAT(); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    eraseAhead(); 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::sync(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_SYNC, 0); 
+    // check mode 
+    if(_mode != FLASH_STORAGE_WRITE_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    // write out everything, including the partial page 
+    _status = writeFIFO(true); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    // record the current end, the file stays open 
+    _fat.files[_opened_file-1].end_addr = _curr_addr; 
+    waitForDevices(); 
+    _status = writeFAT(); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    if(_power_saving) return powerDown(); 
     return FLASH_STORAGE_OK; 
 }
 
+FlashStorage_status_t FlashStorage::emergencyFlush(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_EMERGENCY_FLUSH, 0); 
+    if(_mode != FLASH_STORAGE_WRITE_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    FlashStorage_status_t status = FLASH_STORAGE_OK; 
+    // only what fits in the erased area, there is no time to erase 
+    // the last erased page is kept for the marker, without it recovery would read the unerased page after the data 
+    unsigned int length = _buff_index; 
+    // at the end of the file area recovery stops anyway 
+    unsigned long flush_end = (_max_erased_addr >= _curr_addr + FLASH_STORAGE_PAGE_SIZE) ? _max_erased_addr - FLASH_STORAGE_PAGE_SIZE : _curr_addr; 
+    if(_max_erased_addr >= _area_end) flush_end = _area_end; 
+    if(_curr_addr + length > flush_end){
+        length = flush_end - _curr_addr; 
+        status = FLASH_STORAGE_NO_SPACE; 
+    }
+    programData(_curr_addr, _buff, length); 
+    _curr_addr += length; 
+    _buff_index = 0; 
+    // the marker goes on the next page boundary, if that page is erased 
+    unsigned long marker_addr = (_curr_addr + FLASH_STORAGE_PAGE_SIZE - 1) / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; 
+    if(marker_addr + FLASH_STORAGE_PAGE_SIZE <= _max_erased_addr){
+        byte marker[FLASH_STORAGE_EOD_SIZE]; 
+        marker[0] = FLASH_STORAGE_EOD_ID_0; 
+        marker[1] = FLASH_STORAGE_EOD_ID_1; 
+        marker[2] = FLASH_STORAGE_EOD_ID_2; 
+        marker[3] = _opened_file; 
+        marker[4] = _curr_addr >> 24; 
+        marker[5] = _curr_addr >> 16; 
+        marker[6] = _curr_addr >> 8; 
+        marker[7] = _curr_addr; 
+        unsigned int crc = crc16(marker, FLASH_STORAGE_EOD_SIZE - 2); 
+        marker[8] = crc >> 8; 
+        marker[9] = crc; 
+        programData(marker_addr, marker, FLASH_STORAGE_EOD_SIZE); 
+    }
+    waitForDevices(); 
+    // the FAT keeps the file in-progress for recovery 
+    _fat.files[_opened_file-1].end_addr = _curr_addr; 
+    releaseBuffer(); 
+    _opened_file = 0; 
+    _curr_addr = 0; 
+    _max_erased_addr = 0; 
+    _reserve_addr = 0; 
+    _mode = FLASH_STORAGE_NO_MODE; 
+    return status; 
+}
+
+unsigned long FlashStorage::getEmergencyFlushTime(){
+    if(_mode != FLASH_STORAGE_WRITE_MODE) return 0; 
+    // buffered pages plus the marker page 
+    unsigned long pages = (_curr_addr % FLASH_STORAGE_PAGE_SIZE + _buff_index + FLASH_STORAGE_PAGE_SIZE - 1) / FLASH_STORAGE_PAGE_SIZE + 1; 
+    unsigned long time = pages * FLASH_STORAGE_PROGRAM_MAX_US; 
+    // the longest running operation has to finish first 
+    unsigned long pending = 0; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        unsigned long max_time = 0; 
+        if(_op_type[d] == FLASH_STORAGE_OP_PROGRAM) max_time = FLASH_STORAGE_PROGRAM_MAX_US; 
+        else if(_op_type[d] == FLASH_STORAGE_OP_ERASE) max_time = FLASH_STORAGE_ERASE_MAX_US; 
+        unsigned long elapsed = timeMicros() - _op_start[d]; 
+        if(elapsed < max_time && max_time - elapsed > pending) pending = max_time - elapsed; 
+    }
+#if FLASH_STORAGE_POWER_SAVING 
+    if(_asleep) time += _wake_latency > _wake_time ? _wake_latency : _wake_time; 
+#endif 
+    return time + pending; 
+}
+
 FlashStorage_status_t FlashStorage::close(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_CLOSE, 0); 
     // check the mode 
     if(_mode == FLASH_STORAGE_NO_MODE){
         return FLASH_STORAGE_OK; 
     }
     else if(_mode == FLASH_STORAGE_WRITE_MODE){
         // close out the writing file 
-        // force a write of the buffer 
-        writeFIFO(); 
+        // force a write of the buffer, including the partial page 
+        writeFIFO(true); 
+        releaseBuffer(); 
         // update the FAT table 
         _fat.files[_opened_file-1].end_addr = _curr_addr; 
         // write the FAT table
         _opened_file = 0; 
-        while(_flash.busy()); 
+        waitForDevices(); 
         writeFAT();  
         // update 
         _curr_addr = 0; 
         _max_erased_addr = 0; 
-        _mode == FLASH_STORAGE_NO_MODE; 
+        _reserve_addr = 0; 
+        _mode = FLASH_STORAGE_NO_MODE; 
     }
     else if(_mode == FLASH_STORAGE_READ_MODE){
         // just remove the indexes 
         _opened_file = 0; 
         _curr_addr = 0; 
         _max_erased_addr = 0; 
-        _mode == FLASH_STORAGE_NO_MODE; 
+        _mode = FLASH_STORAGE_NO_MODE; 
     }
+    if(_power_saving) return powerDown(); 
     return FLASH_STORAGE_OK; 
 }
 
 FlashStorage_status_t FlashStorage::write(byte* buff, unsigned int length){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_WRITE, length); 
     // check mode 
     if(_mode != FLASH_STORAGE_WRITE_MODE) return FLASH_STORAGE_WRONG_MODE; 
-    // copy the data into the fifo buffer and write if needed 
-    unsigned int remaining = FLASH_STORAGE_FIFO_BUFFER_SIZE - _buff_index; 
-    if(remaining > length){
-        // preform a straight copy 
-        memcpy(&_buff[_buff_index], buff, length); 
-        _buff_index += length; 
-    }
-    else{ 
-        // otherwise fill up the buffer and trigger a write 
-        unsigned int index = remaining; 
-        memcpy(&_buff[_buff_index], buff, remaining); 
-        _buff_index += remaining; 
-        writeFIFO(); 
-        // fill up the FIFO and keep writing if necessary 
-        while(index + FLASH_STORAGE_FIFO_BUFFER_SIZE < length){ 
-            memcpy(_buff, &buff[index], FLASH_STORAGE_FIFO_BUFFER_SIZE); 
-            index += FLASH_STORAGE_FIFO_BUFFER_SIZE; 
-            _buff_index = FLASH_STORAGE_FIFO_BUFFER_SIZE; 
-            writeFIFO(); 
-            // Serial.println("Looping write"); 
-        }
-        // fill out the remaining data 
-        memcpy(_buff, &buff[index], length - index); 
-        _buff_index += length - index; 
+    // try the look ahead erase before programming as well, the chip is most likely idle here 
+    // in ping pong mode this keeps the erase running on one chip while the other is programmed 
+    // when saving power the erases are left to the next burst 
+    if(_auto_tune && !_power_saving) autoTune(length); 
+    if(!_power_saving) eraseAhead(); 
+    // copy the data into the fifo buffer and write whenever it fills up 
+    // writeFIFO() keeps the sub page tail, so the buffer may not be empty afterwards 
+    unsigned int index = 0; 
+    while(index < length){
+        unsigned int chunk = _buff_size - _buff_index; 
+        if(chunk > length - index) chunk = length - index; 
+        memcpy(&_buff[_buff_index], &buff[index], chunk); 
+        _buff_index += chunk; 
+        index += chunk; 
+        // power saving bursts always fill the FIFO, the watermark only applies while awake 
+        bool full = _buff_index == _buff_size; 
+        if((!_power_saving && _flush_threshold != 0 && _buff_index >= _flush_threshold) || full){
+            _status = writeFIFO(); 
+            if(_status != FLASH_STORAGE_OK) return _status; 
+            // a stream that fills its FIFO borrows more of the pool 
+            if(full) growBuffer(); 
+        }
     } 
-    // check that we're not exceeding the look ahead 
-    if(_curr_addr > _max_erased_addr - _lookahead_erase_size){
-        // trigger a sector erase 
-        return eraseNextSector(); 
+    // end the burst, if there was one 
+    if(_power_saving){
+        if(_asleep) return FLASH_STORAGE_OK; 
+        // no erases until the next burst, leave room for a full FIFO, its end-of-data marker and a blank page 
+        eraseThrough(_curr_addr + _buff_size + 2*FLASH_STORAGE_PAGE_SIZE); 
+        return powerDown(); 
     }
+    // check that we're not exceeding the look ahead, a busy device only delays it to the next call 
+    eraseAhead(); 
     return FLASH_STORAGE_OK; 
 } 
 
 unsigned int FlashStorage::read(byte* buff, unsigned int length){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_READ, length); 
     // check the mode 
     if(_mode != FLASH_STORAGE_READ_MODE) return 0; 
     //Serial.print("Curr Addr: "); 
@@ -165,9 +504,14 @@ unsigned int FlashStorage::read(byte* buff, unsigned int length){
     // read up to the requested amount 
     if(length > _fat.files[_opened_file-1].end_addr - _curr_addr) length = _fat.files[_opened_file-1].end_addr - _curr_addr; 
     //_flash_status = _flash.readData(_curr_addr, buff, length); 
+    if(_fat.files[_opened_file-1].is_inline){
+        // served straight from the cached FAT 
+        memcpy(buff, &_fat.inline_data[_curr_addr], length); 
+        _curr_addr += length; 
+        return length; 
+    }
     // perform a fast read 
-    _flash_status = _flash.fastRead(_curr_addr, buff, length); 
-    if(_flash_status != W25Q64_OK){
+    if(readData(_curr_addr, buff, length) != FLASH_STORAGE_OK){
         Serial.print("Flash Status Code: "); 
         Serial.println(_flash_status); 
         return 0; 
@@ -183,174 +527,1557 @@ unsigned int FlashStorage::peek(){
 }
 
 FlashStorage_status_t FlashStorage::deleteLastFile(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_DELETE_LAST_FILE, 0); 
     // remove the last file from the FAT table 
     // make sure no mode 
     if(_mode != FLASH_STORAGE_NO_MODE) return FLASH_STORAGE_WRONG_MODE; 
     if(_fat.file_count > 0) _fat.file_count --; 
     // write the fat 
-    while(_flash.busy()); 
+    waitForDevices(); 
     writeFAT(); 
     return FLASH_STORAGE_OK; 
 }
 
 FlashStorage_status_t FlashStorage::deleteAllFiles(){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_DELETE_ALL_FILES, 0); 
     // remove the last file from the FAT table 
     // make sure no mode 
     if(_mode != FLASH_STORAGE_NO_MODE) return FLASH_STORAGE_WRONG_MODE; 
     _fat.file_count = 0; 
     // write the fat 
-    while(_flash.busy()); 
+    waitForDevices(); 
     writeFAT(); 
     return FLASH_STORAGE_OK; 
 }
 
-FlashStorage_status_t FlashStorage::writeFIFO(){
-    // write the entire FIFO buffer 
-    // check that the max erased address won't be exceeded 
-    if(_curr_addr + _buff_index >= _max_erased_addr){
-        while(_flash.busy()); 
-        _flash.writeEnable(); 
-        _flash.sectorErase(_max_erased_addr); 
-        _max_erased_addr += 4096; 
-    }
-    // must be performed in 256 byte chunks 
-    // check that we are not in the middle of a page 
-    unsigned int offset = 0; 
-    if(_curr_addr%256 != 0){
-        // need to fill out the last part of the current page 
-        unsigned int remaining = (_curr_addr>>8+1<<8) - _curr_addr; 
-         // wait until free 
-        while(_flash.busy()); 
-        // enable write 
-        _flash.writeEnable(); 
-        _flash.pageProgram(_curr_addr,_buff, remaining); 
-        _curr_addr += remaining; 
-        offset = remaining; 
-    }
-    for(int p = 0; p < (_buff_index-offset)/256 + 1; p ++){
-        // wait until free 
-        while(_flash.busy()); 
-        // enable write 
-        _flash.writeEnable(); 
-        // check the size, can only write up to a page 
-        int size = (_buff_index-offset) - p*256;
-        if(size < 0) size += 256; 
-        if(size > 256) size = 256; 
-        _flash.pageProgram(_curr_addr, &_buff[p*256+offset], size); 
-        //Serial.println("FIFO"); 
-        //Serial.println(size); 
-        //Serial.println(offset); 
-        //Serial.println(p); 
-        _curr_addr += size; 
-    }
-    // update the FAT data
-    // _fat.files[_opened_file-1].end_addr = _curr_addr; 
-    // clear out the fifo 
+FlashStorage_status_t FlashStorage::writePartitionTable(FlashStoragePartition* partitions, unsigned int count){
+#if !FLASH_STORAGE_PARTITIONS 
+    return FLASH_STORAGE_INVALID_CONFIG; 
+#else 
+    if(count == 0 || count > FLASH_STORAGE_MAX_PARTITIONS) return FLASH_STORAGE_INVALID_CONFIG; 
+    close(); 
+    // partitions are whole erase units after the table and must not overlap 
+    for(unsigned int p = 0; p < count; p ++){
+        if(partitions[p].start_addr % _erase_size != 0 || partitions[p].size % _erase_size != 0) return FLASH_STORAGE_INVALID_CONFIG; 
+        if(partitions[p].start_addr < _erase_size || partitions[p].size == 0) return FLASH_STORAGE_INVALID_CONFIG; 
+        if(partitions[p].start_addr + partitions[p].size > _capacity) return FLASH_STORAGE_NO_SPACE; 
+        if(partitions[p].type == FLASH_STORAGE_PARTITION_FILES && partitions[p].size < 2 * _erase_size) return FLASH_STORAGE_INVALID_CONFIG; 
+        for(unsigned int o = 0; o < p; o ++){
+            if(partitions[p].start_addr < partitions[o].start_addr + partitions[o].size && 
+                partitions[o].start_addr < partitions[p].start_addr + partitions[p].size) return FLASH_STORAGE_INVALID_CONFIG; 
+        }
+    }
+    // build the table 
+    char id_string[] = FLASH_STORAGE_PARTITION_ID_STRING;
+    unsigned int id_size = sizeof(id_string)/sizeof(char); 
+    unsigned int table_size = id_size + 2 + count * FLASH_STORAGE_PARTITION_ENTRY_SIZE; 
+    byte buff[FLASH_STORAGE_PARTITION_TABLE_SIZE]; 
+    strcpy((char*)buff, id_string); 
+    buff[id_size] = FLASH_STORAGE_PARTITION_VERSION; 
+    buff[id_size + 1] = count; 
+    for(unsigned int p = 0; p < count; p ++){
+        byte* entry = &buff[id_size + 2 + p*FLASH_STORAGE_PARTITION_ENTRY_SIZE]; 
+        entry[0] = partitions[p].type; 
+        entry[1] = partitions[p].start_addr>>24; 
+        entry[2] = partitions[p].start_addr>>16; 
+        entry[3] = partitions[p].start_addr>>8; 
+        entry[4] = partitions[p].start_addr; 
+        entry[5] = partitions[p].size>>24; 
+        entry[6] = partitions[p].size>>16; 
+        entry[7] = partitions[p].size>>8; 
+        entry[8] = partitions[p].size; 
+        _partitions[p] = partitions[p]; 
+    }
+    _partition_count = count; 
+    _files_mounted = false; 
+    unsigned int crc = crc16(buff, table_size); 
+    buff[table_size] = crc >> 8; 
+    buff[table_size + 1] = crc; 
+    // the table owns the first erase unit 
+    waitForDevices(); 
+    eraseUnit(0); 
+    programData(0, buff, table_size + 2); 
+    waitForDevices(); 
+    // mount the first file partition, its FAT still needs initializeFAT() 
+    for(unsigned int p = 0; p < _partition_count; p ++){
+        if(_partitions[p].type == FLASH_STORAGE_PARTITION_FILES){
+            mountPartition(p); 
+            break; 
+        }
+    }
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
+unsigned int FlashStorage::getPartitionCount(){
+#if FLASH_STORAGE_PARTITIONS 
+    return _partition_count; 
+#else 
+    return 0; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::getPartition(unsigned int index, FlashStoragePartition* partition){
+#if FLASH_STORAGE_PARTITIONS 
+    if(index >= _partition_count) return FLASH_STORAGE_NOT_FOUND; 
+    *partition = _partitions[index]; 
+    return FLASH_STORAGE_OK; 
+#else 
+    return FLASH_STORAGE_NOT_FOUND; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::mountPartition(unsigned int index){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_MOUNT_PARTITION, index); 
+#if !FLASH_STORAGE_PARTITIONS 
+    return FLASH_STORAGE_INVALID_CONFIG; 
+#else 
+    if(index >= _partition_count || _partitions[index].type != FLASH_STORAGE_PARTITION_FILES) return FLASH_STORAGE_INVALID_CONFIG; 
+    // close out anything open on the current partition 
+    close(); 
+    // the FAT is the first erase unit of the partition, files follow 
+    _fat_addr = _partitions[index].start_addr; 
+    _area_limit = _partitions[index].start_addr + _partitions[index].size; 
+    _area_end = _area_limit; 
+    _area_reserved = 0; 
+    _files_mounted = true; 
+    waitForDevices(); 
+    _status = readFAT(); 
+    return _status; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::reserveRegion(unsigned long size, unsigned long* start_addr){
+    TraceScope trace(this, FLASH_STORAGE_TRACE_RESERVE_REGION, size); 
+    if(!_files_mounted) return FLASH_STORAGE_WRONG_MODE; 
+    // take whole erase units off the end of the file area 
+    size = (size + _erase_size - 1) / _erase_size * _erase_size; 
+    if(_fat_addr + _area_reserved + size + _fat_units*_erase_size > _area_limit) return FLASH_STORAGE_NO_SPACE; 
+    // regions are taken from the end of the area in call order, the same calls after a mount give the same regions 
+    unsigned long region = _area_limit - _area_reserved - size; 
+    if(region < _area_end){
+        // files must not already reach into it 
+        for(unsigned int i = 0; i < _fat.file_count; i ++){
+            if(!_fat.files[i].is_inline && _fat.files[i].end_addr > region) return FLASH_STORAGE_NO_SPACE; 
+        }
+        if(_mode == FLASH_STORAGE_WRITE_MODE && _max_erased_addr > region) return FLASH_STORAGE_NO_SPACE; 
+    }
+    _area_reserved += size; 
+    *start_addr = region; 
+    // the FAT mounted at init() may already end before the region 
+    if(region >= _area_end) return FLASH_STORAGE_OK; 
+    _area_end = region; 
+    // record the new end, recovery must not scan into the region and files must not be placed in it before the 
+    // next reserveRegion() 
+    if(_mode == FLASH_STORAGE_WRITE_MODE || _fat_sequence != 0){
+        waitForDevices(); 
+        return writeFAT(); 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+unsigned long FlashStorage::getRecoveryTime(){
+    return _recovery_time; 
+}
+
+unsigned long FlashStorage::getEraseSize(){
+    return _erase_size; 
+}
+
+FlashStorage_status_t FlashStorage::setBusArbitration(unsigned long max_hold_us, unsigned long bus_clock_hz, FlashStorage_yield_callback_t callback, void* context){
+    // bytes that fit in the hold time, less the command overhead 
+    unsigned long bytes_per_second = bus_clock_hz / 8; 
+    unsigned long bytes = 0; 
+    unsigned long chunk = 0; 
+    // 0 reads without splitting 
+    if(max_hold_us == 0) chunk = 0; 
+    else if(bytes_per_second == 0 || max_hold_us <= 0xFFFFFFFF / bytes_per_second) bytes = bytes_per_second * max_hold_us / 1000000; 
+    // long hold times at ms resolution so the product fits in 32 bits 
+    else if(max_hold_us / 1000 <= 0xFFFFFFFF / (bytes_per_second / 1000 + 1)) bytes = (bytes_per_second / 1000) * (max_hold_us / 1000); 
+    // anything longer is no limit 
+    else max_hold_us = 0; 
+    if(max_hold_us != 0){
+        // a hold time that only fits the command would read a byte per transfer 
+        if(bytes <= FLASH_STORAGE_READ_OVERHEAD + 1) return FLASH_STORAGE_INVALID_CONFIG; 
+        chunk = bytes - FLASH_STORAGE_READ_OVERHEAD; 
+    }
+    _bus_chunk = chunk; 
+    _yield_callback = callback; 
+    _yield_context = context; 
+    return FLASH_STORAGE_OK; 
+}
+
+void FlashStorage::setClockCallback(FlashStorage_clock_callback_t callback, void* context){
+#if FLASH_STORAGE_CLOCK_CALIBRATION 
+    _clock_callback = callback; 
+    _clock_context = context; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::calibrateClock(unsigned long* rates, unsigned int rate_count){
+#if !FLASH_STORAGE_CLOCK_CALIBRATION 
+    return FLASH_STORAGE_INVALID_CONFIG; 
+#else 
+    if(_clock_callback == NULL || rate_count == 0) return FLASH_STORAGE_INVALID_CONFIG; 
+    if(_mode != FLASH_STORAGE_NO_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    waitForDevices(); 
+    for(unsigned int d = 0; d < _device_count; d ++) _clock_callback(d, rates[0], _clock_context); 
+    // the scratch pages sit below the calibration record and above the largest possible FAT 
+    char id_string[] = FLASH_STORAGE_IDENTIFICATION_STRING;
+    unsigned int fat_max = sizeof(id_string) + FLASH_STORAGE_FAT_HEADER_SIZE + FLASH_STORAGE_MAX_DEVICES*FLASH_STORAGE_FAT_DEVICE_SIZE + FLASH_STORAGE_MAX_FILE_NUMBER*FLASH_STORAGE_FAT_ENTRY_SIZE + 2 + FLASH_STORAGE_INLINE_POOL_SIZE + 2; 
+    fat_max = (fat_max + FLASH_STORAGE_PAGE_SIZE - 1) / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; 
+    unsigned long unit = _fat_addr + _fat_active*_erase_size; 
+    // they have to be blank, a FAT write leaves them erased 
+    if(!isErased(unit + fat_max, _erase_size - FLASH_STORAGE_PAGE_SIZE - fat_max)){
+        _status = writeFAT(); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
+        unit = _fat_addr + _fat_active*_erase_size; 
+    }
+    // find a scratch page on every device 
+    unsigned long scratch_low = unit + fat_max; 
+    bool has_scratch[FLASH_STORAGE_MAX_DEVICES]; 
+    unsigned long scratch[FLASH_STORAGE_MAX_DEVICES]; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        has_scratch[d] = false; 
+        scratch[d] = 0; 
+    }
+    unsigned long page = unit + _erase_size - 2*FLASH_STORAGE_PAGE_SIZE; 
+    while(page >= scratch_low){
+        unsigned int device; 
+        unsigned long local; 
+        mapAddress(page, &device, &local); 
+        if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED){
+            // the same page exists on every mirror 
+            for(unsigned int d = 0; d < _device_count; d ++){
+                has_scratch[d] = true; 
+                scratch[d] = local; 
+            }
+            break; 
+        }
+        if(!has_scratch[device]){
+            has_scratch[device] = true; 
+            scratch[device] = local; 
+        }
+        page -= FLASH_STORAGE_PAGE_SIZE; 
+    }
+    // program the pattern, alternating bits and walking ones and zeros 
+    byte pattern[FLASH_STORAGE_PAGE_SIZE]; 
+    for(unsigned int i = 0; i < FLASH_STORAGE_PAGE_SIZE; i ++){
+        byte bit = 1 << (i / 4 % 8); 
+        if(i % 4 == 0) pattern[i] = 0x55; 
+        else if(i % 4 == 1) pattern[i] = 0xAA; 
+        else if(i % 4 == 2) pattern[i] = bit; 
+        else pattern[i] = ~bit; 
+    }
+    for(unsigned int d = 0; d < _device_count; d ++){
+        if(!has_scratch[d]) continue; 
+        waitForDevice(d); 
+        programPage(d, scratch[d], pattern, FLASH_STORAGE_PAGE_SIZE); 
+    }
+    waitForDevices(); 
+    // step each device up until a read back fails 
+    byte buff[FLASH_STORAGE_PAGE_SIZE]; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        _clock_rate[d] = rates[0]; 
+        if(!has_scratch[d]) continue; 
+        unsigned int passed = 0; 
+        while(passed < rate_count){
+            _clock_callback(d, rates[passed], _clock_context); 
+            bool ok = true; 
+            for(unsigned int r = 0; r < FLASH_STORAGE_CALIBRATION_READS && ok; r ++){
+                ok = _flash[d].fastRead(scratch[d], buff, FLASH_STORAGE_PAGE_SIZE) == W25Q64_OK && memcmp(buff, pattern, FLASH_STORAGE_PAGE_SIZE) == 0; 
+            }
+            if(!ok) break; 
+            passed ++; 
+        }
+        if(passed == 0){
+            _clock_callback(d, rates[0], _clock_context); 
+            return FLASH_STORAGE_FLASH_FAIL; 
+        }
+        // back off one step for margin 
+        _clock_rate[d] = (passed > 1) ? rates[passed - 2] : rates[0]; 
+        _clock_callback(d, _clock_rate[d], _clock_context); 
+    }
+    // save the rates. The table moves to the other unit, the scratch pages stay programmed until a FAT write erases 
+    // this unit again (the blank check above does it before the next calibration) 
+    _clock_calibrated = true; 
+    return writeFAT(); 
+#endif 
+}
+
+unsigned long FlashStorage::getClockRate(unsigned int device){
+#if FLASH_STORAGE_CLOCK_CALIBRATION 
+    if(device >= _device_count || !_clock_calibrated) return 0; 
+    return _clock_rate[device]; 
+#else 
+    return 0; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::recoverFile(unsigned int file_index, unsigned long scan_end){
+    unsigned long end_addr = _fat.files[file_index-1].end_addr; 
+    // regions reserved at the end of the area are not re-reserved yet at init, stop where the FAT says the area ended 
+    if(scan_end == 0 || scan_end > _area_end) scan_end = _area_end; 
+    unsigned long recovered = 0xFFFFFFFF; 
+    byte buff[FLASH_STORAGE_PAGE_SIZE]; 
+    // a mirror may have been cut off mid program, keep what every copy holds 
+    unsigned int copies = (_array_mode == FLASH_STORAGE_ARRAY_MIRRORED) ? _device_count : 1; 
+    for(unsigned int c = 0; c < copies; c ++){
+        unsigned long last_data = end_addr; 
+        // walk the pages after the recorded end 
+        for(unsigned long addr = end_addr / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; addr < scan_end; addr += FLASH_STORAGE_PAGE_SIZE){
+            if(copies > 1){
+                if(_flash[c].fastRead(addr, buff, FLASH_STORAGE_PAGE_SIZE) != W25Q64_OK) return FLASH_STORAGE_FLASH_FAIL; 
+            }
+            else{
+                _status = readData(addr, buff, FLASH_STORAGE_PAGE_SIZE); 
+                if(_status != FLASH_STORAGE_OK) return _status; 
+            }
+            // an end-of-data marker left by emergencyFlush() 
+            if(buff[0] == FLASH_STORAGE_EOD_ID_0 && buff[1] == FLASH_STORAGE_EOD_ID_1 && buff[2] == FLASH_STORAGE_EOD_ID_2 && buff[3] == file_index){
+                unsigned int crc = (unsigned int)buff[8] << 8 | buff[9]; 
+                unsigned long marker_end = (unsigned long)buff[4] << 24 | (unsigned long)buff[5] << 16 | (unsigned long)buff[6] << 8 | buff[7]; 
+                if(crc == crc16(buff, FLASH_STORAGE_EOD_SIZE - 2) && marker_end >= end_addr && marker_end <= addr){
+                    last_data = marker_end; 
+                    break; 
+                }
+            }
+            // otherwise the first blank page ends the data 
+            int last = FLASH_STORAGE_PAGE_SIZE - 1; 
+            while(last >= 0 && buff[last] == 0xFF) last --; 
+            if(last < 0) break; 
+            // a marker cut off mid program, nothing of the file is on its page 
+            if(buff[0] == FLASH_STORAGE_EOD_ID_0 && last < FLASH_STORAGE_EOD_SIZE) break; 
+            if(addr + last + 1 > last_data) last_data = addr + last + 1; 
+        }
+        if(last_data < recovered) recovered = last_data; 
+    }
+    _fat.files[file_index-1].end_addr = recovered; 
+    // clears the in-progress index 
+    waitForDevices(); 
+    return writeFAT(); 
+}
+
+FlashStorage_status_t FlashStorage::readCalibration(){
+#if !FLASH_STORAGE_CLOCK_CALIBRATION 
+    return FLASH_STORAGE_NOT_FOUND; 
+#else 
+    _clock_calibrated = false; 
+    unsigned int record_size = 3 + 4*_device_count + 2; 
+    byte buff[3 + 4*FLASH_STORAGE_MAX_DEVICES + 2]; 
+    readData(_fat_addr + (_fat_active + 1)*_erase_size - FLASH_STORAGE_PAGE_SIZE, buff, record_size); 
+    if(buff[0] != FLASH_STORAGE_CLOCK_ID_0 || buff[1] != FLASH_STORAGE_CLOCK_ID_1 || buff[2] != _device_count) return FLASH_STORAGE_NOT_FOUND; 
+    unsigned int crc = (unsigned int)buff[record_size - 2] << 8 | buff[record_size - 1]; 
+    if(crc != crc16(buff, record_size - 2)) return FLASH_STORAGE_NOT_FOUND; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        byte* rate = &buff[3 + 4*d]; 
+        _clock_rate[d] = (unsigned long)rate[0] << 24 | (unsigned long)rate[1] << 16 | (unsigned long)rate[2] << 8 | rate[3]; 
+        if(_clock_callback != NULL) _clock_callback(d, _clock_rate[d], _clock_context); 
+    }
+    _clock_calibrated = true; 
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::writeCalibration(){
+#if !FLASH_STORAGE_CLOCK_CALIBRATION 
+    return FLASH_STORAGE_INVALID_CONFIG; 
+#else 
+    unsigned int record_size = 3 + 4*_device_count + 2; 
+    byte buff[3 + 4*FLASH_STORAGE_MAX_DEVICES + 2]; 
+    buff[0] = FLASH_STORAGE_CLOCK_ID_0; 
+    buff[1] = FLASH_STORAGE_CLOCK_ID_1; 
+    buff[2] = _device_count; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        byte* rate = &buff[3 + 4*d]; 
+        rate[0] = _clock_rate[d] >> 24; 
+        rate[1] = _clock_rate[d] >> 16; 
+        rate[2] = _clock_rate[d] >> 8; 
+        rate[3] = _clock_rate[d]; 
+    }
+    unsigned int crc = crc16(buff, record_size - 2); 
+    buff[record_size - 2] = crc >> 8; 
+    buff[record_size - 1] = crc; 
+    return programData(_fat_addr + (_fat_active + 1)*_erase_size - FLASH_STORAGE_PAGE_SIZE, buff, record_size); 
+#endif 
+}
+
+void FlashStorage::setPowerCallback(FlashStorage_power_callback_t callback, void* context, unsigned long wake_us){
+#if FLASH_STORAGE_POWER_SAVING 
+    _power_callback = callback; 
+    _power_context = context; 
+    _wake_time = wake_us; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::setPowerSaving(bool enabled){
+#if FLASH_STORAGE_POWER_SAVING 
+    if(enabled && _power_callback == NULL) return FLASH_STORAGE_INVALID_CONFIG; 
+    _power_saving = enabled; 
+    if(enabled) return powerDown(); 
+    wakeDevices(); 
+    return FLASH_STORAGE_OK; 
+#else 
+    return enabled ? FLASH_STORAGE_INVALID_CONFIG : FLASH_STORAGE_OK; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::powerDown(){
+#if !FLASH_STORAGE_POWER_SAVING 
+    return FLASH_STORAGE_INVALID_CONFIG; 
+#else 
+    if(_power_callback == NULL) return FLASH_STORAGE_INVALID_CONFIG; 
+    if(_asleep) return FLASH_STORAGE_OK; 
+    // power-down is ignored while a program or erase is running 
+    waitForDevices(); 
+    for(unsigned int d = 0; d < _device_count; d ++) _power_callback(d, false, _power_context); 
+    _asleep = true; 
+    if(_wake_count > 0) _awake_time += timeMicros() - _awake_start; 
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
+void FlashStorage::wakeDevices(){
+#if FLASH_STORAGE_POWER_SAVING 
+    if(!_asleep) return; 
+    unsigned long start = timeMicros(); 
+    for(unsigned int d = 0; d < _device_count; d ++) _power_callback(d, true, _power_context); 
+    sleepMicros(_wake_time); 
+    _asleep = false; 
+    _awake_start = timeMicros(); 
+    // track the wake cost 
+    if(_awake_start - start > _wake_latency) _wake_latency = _awake_start - start; 
+    _wake_count ++; 
+#endif 
+}
+
+void FlashStorage::getPowerStats(unsigned long* wake_count, unsigned long* wake_latency_us, unsigned long* awake_us){
+#if FLASH_STORAGE_POWER_SAVING 
+    *wake_count = _wake_count; 
+    *wake_latency_us = _wake_latency; 
+    *awake_us = _awake_time; 
+    if(!_asleep && _wake_count > 0) *awake_us += timeMicros() - _awake_start; 
+#else 
+    *wake_count = 0; 
+    *wake_latency_us = 0; 
+    *awake_us = 0; 
+#endif 
+}
+
+void FlashStorage::setTimeCallbacks(FlashStorage_time_callback_t time_callback, FlashStorage_delay_callback_t delay_callback, void* context){
+    _time_callback = time_callback; 
+    _delay_callback = delay_callback; 
+    _time_context = context; 
+}
+
+void FlashStorage::setTrace(byte* buff, unsigned int size){
+#if FLASH_STORAGE_TRACE 
+    _trace_buff = buff; 
+    _trace_capacity = (buff == NULL) ? 0 : size / FLASH_STORAGE_TRACE_RECORD_SIZE; 
+    _trace_head = 0; 
+    _trace_count = 0; 
+#endif 
+}
+
+unsigned int FlashStorage::getTraceCount(){
+#if FLASH_STORAGE_TRACE 
+    return _trace_count; 
+#else 
+    return 0; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::getTraceRecord(unsigned int index, FlashStorageTraceRecord* record){
+#if !FLASH_STORAGE_TRACE 
+    return FLASH_STORAGE_NOT_FOUND; 
+#else 
+    if(index >= _trace_count) return FLASH_STORAGE_NOT_FOUND; 
+    // the oldest record sits at the head once the ring has wrapped 
+    unsigned int slot = (_trace_head + _trace_capacity - _trace_count + index) % _trace_capacity; 
+    byte* entry = &_trace_buff[slot * FLASH_STORAGE_TRACE_RECORD_SIZE]; 
+    record->op = (FlashStorageTraceOp)entry[0]; 
+    record->arg = (unsigned long)entry[1] << 16 | (unsigned long)entry[2] << 8 | entry[3]; 
+    record->start_us = (unsigned long)entry[4] << 24 | (unsigned long)entry[5] << 16 | (unsigned long)entry[6] << 8 | entry[7]; 
+    record->duration_us = (unsigned long)entry[8] << 24 | (unsigned long)entry[9] << 16 | (unsigned long)entry[10] << 8 | entry[11]; 
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
+void FlashStorage::setWriteStats(bool enabled){
+#if FLASH_STORAGE_WRITE_STATS 
+    _write_stats = enabled; 
+    if(!enabled) return; 
+    _stats_start = timeMicros(); 
+    _stats_bytes = 0; 
+    _stats_max = 0; 
+    for(unsigned int b = 0; b < FLASH_STORAGE_LATENCY_BUCKETS; b ++) _latency_histogram[b] = 0; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::getWriteStats(FlashStorageWriteStats* stats){
+#if !FLASH_STORAGE_WRITE_STATS 
+    memset(stats, 0, sizeof(FlashStorageWriteStats)); 
+    return FLASH_STORAGE_NOT_FOUND; 
+#else 
+    stats->count = 0; 
+    for(unsigned int b = 0; b < FLASH_STORAGE_LATENCY_BUCKETS; b ++) stats->count += _latency_histogram[b]; 
+    stats->bytes = _stats_bytes; 
+    stats->elapsed_us = timeMicros() - _stats_start; 
+    stats->max_us = _stats_max; 
+    stats->p50_us = 0; 
+    stats->p99_us = 0; 
+    if(stats->count == 0) return FLASH_STORAGE_NOT_FOUND; 
+    // walk the histogram until the percentile is covered 
+    unsigned long p50 = (stats->count + 1) / 2; 
+    unsigned long p99 = stats->count - stats->count / 100; 
+    unsigned long seen = 0; 
+    for(unsigned int b = 0; b < FLASH_STORAGE_LATENCY_BUCKETS; b ++){
+        seen += _latency_histogram[b]; 
+        unsigned long bound = (b == FLASH_STORAGE_LATENCY_BUCKETS - 1) ? _stats_max : ((unsigned long)2 << b) - 1; 
+        if(bound > _stats_max) bound = _stats_max; 
+        if(stats->p50_us == 0 && seen >= p50) stats->p50_us = bound; 
+        if(seen >= p99){
+            stats->p99_us = bound; 
+            break; 
+        }
+    }
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::replayTrace(FlashStorageTraceRecord* records, unsigned int count, byte* data, unsigned int data_size){
+    // writes and reads go through data, an empty buffer would never finish them 
+    if(data == NULL || data_size == 0) return FLASH_STORAGE_INVALID_CONFIG; 
+    FlashStorage_status_t result = FLASH_STORAGE_OK; 
+    unsigned long replay_start = timeMicros(); 
+    for(unsigned int r = 0; r < count; r ++){
+        // keep the recorded spacing 
+        unsigned long offset = records[r].start_us - records[0].start_us; 
+        unsigned long elapsed = timeMicros() - replay_start; 
+        if(elapsed < offset) sleepMicros(offset - elapsed); 
+        FlashStorage_status_t status = FLASH_STORAGE_OK; 
+        unsigned long remaining = records[r].arg; 
+        switch(records[r].op){
+            case FLASH_STORAGE_TRACE_NEW_FILE: 
+                status = newFile(); 
+                break; 
+            case FLASH_STORAGE_TRACE_WRITE: 
+                // one call per recorded write where data allows 
+                do{
+                    unsigned int size = remaining > data_size ? data_size : remaining; 
+                    status = write(data, size); 
+                    remaining -= size; 
+                } while(remaining > 0 && (status == FLASH_STORAGE_OK || status == FLASH_STORAGE_BUSY)); 
+                break; 
+            case FLASH_STORAGE_TRACE_CLOSE: 
+                status = close(); 
+                break; 
+            case FLASH_STORAGE_TRACE_OPEN_FILE: 
+                status = openFile(records[r].arg); 
+                break; 
+            case FLASH_STORAGE_TRACE_READ: 
+                while(remaining > 0){
+                    unsigned int size = remaining > data_size ? data_size : remaining; 
+                    if(read(data, size) != size) break; 
+                    remaining -= size; 
+                }
+                break; 
+            case FLASH_STORAGE_TRACE_SYNC: 
+                status = sync(); 
+                break; 
+            case FLASH_STORAGE_TRACE_WRITE_FILE: 
+                if(remaining <= data_size){
+                    status = writeFile(data, remaining); 
+                    break; 
+                }
+                // longer than data, it was stored as a regular file 
+                status = newFile(); 
+                while(remaining > 0 && status == FLASH_STORAGE_OK){
+                    unsigned int size = remaining > data_size ? data_size : remaining; 
+                    status = write(data, size); 
+                    remaining -= size; 
+                }
+                if(status == FLASH_STORAGE_OK) status = close(); 
+                break; 
+            case FLASH_STORAGE_TRACE_OPEN_FOR_APPEND: 
+                status = openForAppend(records[r].arg); 
+                break; 
+            case FLASH_STORAGE_TRACE_RESERVE: 
+                status = reserve(records[r].arg, true); 
+                break; 
+            case FLASH_STORAGE_TRACE_RESERVE_BACKGROUND: 
+                status = reserve(records[r].arg, false); 
+                break; 
+            case FLASH_STORAGE_TRACE_POLL: 
+                status = poll(); 
+                break; 
+            case FLASH_STORAGE_TRACE_EMERGENCY_FLUSH: 
+                status = emergencyFlush(); 
+                break; 
+            case FLASH_STORAGE_TRACE_DELETE_LAST_FILE: 
+                status = deleteLastFile(); 
+                break; 
+            case FLASH_STORAGE_TRACE_DELETE_ALL_FILES: 
+                status = deleteAllFiles(); 
+                break; 
+            case FLASH_STORAGE_TRACE_INITIALIZE_FAT: 
+                status = initializeFAT(); 
+                break; 
+            case FLASH_STORAGE_TRACE_MOUNT_PARTITION: 
+                status = mountPartition(records[r].arg); 
+                break; 
+            case FLASH_STORAGE_TRACE_RESERVE_REGION: {
+                unsigned long start_addr; 
+                status = reserveRegion(records[r].arg, &start_addr); 
+                break; 
+            }
+            default: 
+                status = FLASH_STORAGE_INVALID_CONFIG; 
+        }
+        // poll() reports a background reserve still running as busy, that is not a failure 
+        if(status != FLASH_STORAGE_OK && status != FLASH_STORAGE_BUSY) result = status; 
+    }
+    return result; 
+}
+
+FlashStorage::TraceScope::TraceScope(FlashStorage* storage, FlashStorageTraceOp op, unsigned long arg){
+#if FLASH_STORAGE_TRACE || FLASH_STORAGE_WRITE_STATS 
+    _storage = storage; 
+    _op = op; 
+    _arg = arg; 
+    _storage->_trace_depth ++; 
+    _start = (_storage->_trace_capacity != 0 || _storage->_write_stats) ? _storage->timeMicros() : 0; 
+#endif 
+}
+
+FlashStorage::TraceScope::~TraceScope(){
+#if FLASH_STORAGE_TRACE || FLASH_STORAGE_WRITE_STATS 
+    _storage->_trace_depth --; 
+    if(_storage->_trace_depth != 0) return; 
+    if(_storage->_trace_capacity == 0 && !_storage->_write_stats) return; 
+    unsigned long duration = _storage->timeMicros() - _start; 
+#if FLASH_STORAGE_WRITE_STATS 
+    if(_storage->_write_stats && _op == FLASH_STORAGE_TRACE_WRITE){
+        unsigned int bucket = 0; 
+        while(bucket < FLASH_STORAGE_LATENCY_BUCKETS - 1 && (duration >> (bucket + 1)) != 0) bucket ++; 
+        _storage->_latency_histogram[bucket] ++; 
+        _storage->_stats_bytes += _arg; 
+        if(duration > _storage->_stats_max) _storage->_stats_max = duration; 
+    }
+#endif 
+#if FLASH_STORAGE_TRACE 
+    if(_storage->_trace_capacity == 0) return; 
+    byte* entry = &_storage->_trace_buff[_storage->_trace_head * FLASH_STORAGE_TRACE_RECORD_SIZE]; 
+    // arguments past 3 bytes are clipped 
+    if(_arg > 0xFFFFFF) _arg = 0xFFFFFF; 
+    entry[0] = _op; 
+    entry[1] = _arg >> 16; 
+    entry[2] = _arg >> 8; 
+    entry[3] = _arg; 
+    entry[4] = _start >> 24; 
+    entry[5] = _start >> 16; 
+    entry[6] = _start >> 8; 
+    entry[7] = _start; 
+    entry[8] = duration >> 24; 
+    entry[9] = duration >> 16; 
+    entry[10] = duration >> 8; 
+    entry[11] = duration; 
+    _storage->_trace_head = (_storage->_trace_head + 1) % _storage->_trace_capacity; 
+    if(_storage->_trace_count < _storage->_trace_capacity) _storage->_trace_count ++; 
+#endif 
+#endif 
+}
+
+FlashStorage_status_t FlashStorage::setLookahead(unsigned long bytes){
+    if(bytes < _min_lookahead || bytes > FLASH_STORAGE_MAX_LOOKAHEAD_SIZE) return FLASH_STORAGE_INVALID_CONFIG; 
+    _lookahead_erase_size = bytes; 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::setFlushThreshold(unsigned int bytes){
+    if(bytes != 0 && bytes < FLASH_STORAGE_PAGE_SIZE) return FLASH_STORAGE_INVALID_CONFIG; 
+    _flush_threshold = bytes / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::setBuffer(byte* buff, unsigned int size){
+    if(_mode != FLASH_STORAGE_NO_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    _pool = NULL; 
+    if(buff == NULL){
+#if FLASH_STORAGE_FIFO_BUFFER_SIZE > 0 
+        _buff = _fifo; 
+#else 
+        _buff = NULL; 
+#endif 
+        _buff_size = FLASH_STORAGE_FIFO_BUFFER_SIZE; 
+        return FLASH_STORAGE_OK; 
+    }
+    if(size == 0 || size % FLASH_STORAGE_PAGE_SIZE != 0) return FLASH_STORAGE_INVALID_CONFIG; 
+    _buff = buff; 
+    _buff_size = size; 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::setBufferPool(FlashStorageBufferPool* pool, unsigned int pages, unsigned int max_pages){
+    if(_mode != FLASH_STORAGE_NO_MODE) return FLASH_STORAGE_WRONG_MODE; 
+    if(pool == NULL) return setBuffer(NULL, 0); 
+    if(max_pages == 0) max_pages = pages; 
+    if(pages == 0 || max_pages < pages) return FLASH_STORAGE_INVALID_CONFIG; 
+    _pool = pool; 
+    _pool_pages = pages; 
+    _pool_max_pages = max_pages; 
+    _buff = NULL; 
+    _buff_size = 0; 
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::acquireBuffer(){
+    if(_pool != NULL){
+        unsigned int blocks; 
+        _buff = _pool->acquire(_pool_pages, 1, &blocks); 
+        if(_buff == NULL) return FLASH_STORAGE_NO_SPACE; 
+        _buff_size = blocks * FLASH_STORAGE_PAGE_SIZE; 
+    }
+    if(_buff == NULL) return FLASH_STORAGE_NO_SPACE; 
+    _buff_index = 0; 
+    return FLASH_STORAGE_OK; 
+}
+
+void FlashStorage::releaseBuffer(){
     _buff_index = 0; 
-    // trigger a new erase if needed 
-    //Serial.print("END FIFO"); 
-    //Serial.println(_curr_addr); 
+    if(_pool == NULL || _buff == NULL) return; 
+    _pool->release(_buff, _buff_size / FLASH_STORAGE_PAGE_SIZE); 
+    _buff = NULL; 
+    _buff_size = 0; 
+}
+
+void FlashStorage::growBuffer(){
+    unsigned int blocks = _buff_size / FLASH_STORAGE_PAGE_SIZE; 
+    if(_pool == NULL || _buff == NULL || blocks >= _pool_max_pages) return; 
+    // the current run is free again while the pool looks, so a run at least as long is always found 
+    _pool->release(_buff, blocks); 
+    unsigned int acquired; 
+    byte* buff = _pool->acquire(_pool_max_pages, blocks, &acquired); 
+    if(buff != _buff) memmove(buff, _buff, _buff_index); 
+    _buff = buff; 
+    _buff_size = acquired * FLASH_STORAGE_PAGE_SIZE; 
+}
+
+void FlashStorage::setAutoTune(bool enabled){
+    _auto_tune = enabled; 
+    _arrival_rate = 0; 
+    _write_gap = 0; 
+    _last_write = 0; 
+}
 
+unsigned long FlashStorage::getLookahead(){
+    return _lookahead_erase_size; 
+}
+
+unsigned int FlashStorage::getFlushThreshold(){
+    if(_flush_threshold == 0 || _flush_threshold > _buff_size) return _buff_size; 
+    return _flush_threshold; 
+}
+
+unsigned long FlashStorage::getArrivalRate(){
+    return _arrival_rate; 
+}
+
+void FlashStorage::autoTune(unsigned int length){
+    unsigned long now = timeMicros(); 
+    unsigned long gap = now - _last_write; 
+    bool first = _last_write == 0; 
+    _last_write = now; 
+    if(first || gap == 0) return; 
+    // average the spacing and the rate (1/8 weight) 
+    unsigned long rate = (unsigned long)((unsigned long long)length * 1000000 / gap); 
+    if(_write_gap == 0){
+        _write_gap = gap; 
+        _arrival_rate = rate; 
+    }
+    else{
+        _write_gap = (_write_gap * 7 + gap) / 8; 
+        _arrival_rate = (unsigned long)(((unsigned long long)_arrival_rate * 7 + rate) / 8); 
+    }
+    // slowest device decides 
+    unsigned long erase_us = 0; 
+    unsigned long program_us = 0; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        if(_erase_time[d] > erase_us) erase_us = _erase_time[d]; 
+        if(_program_time[d] > program_us) program_us = _program_time[d]; 
+    }
+    // erase far enough ahead that the writer doesn't catch up with a running erase 
+    unsigned long long lookahead = (unsigned long long)_arrival_rate * erase_us / 1000000 + _erase_size; 
+    if(lookahead < _min_lookahead) lookahead = _min_lookahead; 
+    if(lookahead > FLASH_STORAGE_MAX_LOOKAHEAD_SIZE) lookahead = FLASH_STORAGE_MAX_LOOKAHEAD_SIZE; 
+    _lookahead_erase_size = lookahead; 
+    // flush bursts that fit in the gap between writes, striped pages program in parallel 
+    unsigned long parallel = (_array_mode == FLASH_STORAGE_ARRAY_STRIPED) ? _device_count : 1; 
+    unsigned long pages = _write_gap * parallel / (program_us + 1); 
+    unsigned long threshold = pages * FLASH_STORAGE_PAGE_SIZE; 
+    if(threshold < FLASH_STORAGE_PAGE_SIZE) threshold = FLASH_STORAGE_PAGE_SIZE; 
+    if(threshold > _buff_size) threshold = _buff_size; 
+    _flush_threshold = threshold; 
+}
+
+void FlashStorage::setProgramCallback(FlashStorage_program_callback_t callback, void* context){
+    _program_callback = callback; 
+    _program_context = context; 
+    for(unsigned int d = 0; d < FLASH_STORAGE_MAX_DEVICES; d ++) _program_fallback[d] = false; 
+}
+
+FlashStorage_status_t FlashStorage::readRaw(unsigned long addr, byte* buff, unsigned int length){
+    waitForDevices(); 
+    return readData(addr, buff, length); 
+}
+
+FlashStorage_status_t FlashStorage::programRaw(unsigned long addr, byte* buff, unsigned int length){
+    return programData(addr, buff, length); 
+}
+
+FlashStorage_status_t FlashStorage::eraseRaw(unsigned long addr){
+    return eraseUnit(addr); 
+}
+
+FlashStorage_status_t FlashStorage::writeFIFO(bool flush_all){
+    // only write up to the last page boundary unless told to flush everything 
+    unsigned int length = _buff_index; 
+    if(!flush_all){
+        unsigned long page_end = (_curr_addr + _buff_index) / FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_PAGE_SIZE; 
+        if(page_end <= _curr_addr) return FLASH_STORAGE_OK; 
+        length = page_end - _curr_addr; 
+    }
+    if(length == 0) return FLASH_STORAGE_OK; 
+    // the file area ends where reserveRegion() starts 
+    if(_curr_addr + length > _area_end) return FLASH_STORAGE_NO_SPACE; 
+    // check that the max erased address won't be exceeded 
+    // the page after the data is kept erased as well, recovery stops at the first blank page 
+    _status = eraseThrough(_curr_addr + length + FLASH_STORAGE_PAGE_SIZE); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    // programData splits this into 256 byte page programs 
+    _status = programData(_curr_addr, _buff, length); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    _curr_addr += length; 
+    // keep the tail at the front of the fifo 
+    _buff_index -= length; 
+    memmove(_buff, &_buff[length], _buff_index); 
     return FLASH_STORAGE_OK; 
 }
 
+FlashStorage_status_t FlashStorage::readPartitionTable(){
+    char id_string[] = FLASH_STORAGE_PARTITION_ID_STRING;
+    unsigned int id_size = sizeof(id_string)/sizeof(char); 
+    byte header[sizeof(id_string) + 2]; 
+    _status = readData(0, header, id_size + 2); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    if(strcmp(id_string, (char*)header) != 0 || header[id_size] != FLASH_STORAGE_PARTITION_VERSION) return FLASH_STORAGE_NOT_FOUND; 
+#if !FLASH_STORAGE_PARTITIONS 
+    // only the table's presence is checked, init() refuses the volume 
+    return FLASH_STORAGE_OK; 
+#else 
+    unsigned int count = header[id_size + 1]; 
+    if(count == 0 || count > FLASH_STORAGE_MAX_PARTITIONS) return FLASH_STORAGE_NOT_FOUND; 
+    unsigned int table_size = id_size + 2 + count * FLASH_STORAGE_PARTITION_ENTRY_SIZE; 
+    byte buff[FLASH_STORAGE_PARTITION_TABLE_SIZE]; 
+    readData(0, buff, table_size + 2); 
+    unsigned int crc = (unsigned int)buff[table_size] << 8 | buff[table_size + 1]; 
+    if(crc != crc16(buff, table_size)) return FLASH_STORAGE_NOT_FOUND; 
+    for(unsigned int p = 0; p < count; p ++){
+        byte* entry = &buff[id_size + 2 + p*FLASH_STORAGE_PARTITION_ENTRY_SIZE]; 
+        _partitions[p].type = (FlashStoragePartitionType)entry[0]; 
+        _partitions[p].start_addr = (unsigned long)entry[1] << 24 | (unsigned long)entry[2] << 16 | (unsigned long)entry[3] << 8 | entry[4]; 
+        _partitions[p].size = (unsigned long)entry[5] << 24 | (unsigned long)entry[6] << 16 | (unsigned long)entry[7] << 8 | entry[8]; 
+    }
+    _partition_count = count; 
+    return FLASH_STORAGE_OK; 
+#endif 
+}
+
 FlashStorage_status_t FlashStorage::readFAT(){
+    unsigned long start = timeMicros(); 
+    FlashStorage_status_t found = FLASH_STORAGE_NO_FAT_FOUND; 
+    // mirrored arrays check each copy until a valid one is found 
+    unsigned int copies = (_array_mode == FLASH_STORAGE_ARRAY_MIRRORED) ? _device_count : 1; 
+    _read_pinned = true; 
+    for(unsigned int c = 0; c < copies && found != FLASH_STORAGE_OK && found != FLASH_STORAGE_INVALID_CONFIG; c ++){
+        _read_device = c; 
+        // the first unit tells if the table alternates between two units 
+        FlashStorageFATHeader headers[2]; 
+        FlashStorage_status_t status[2]; 
+        status[0] = parseFAT(_fat_addr, false, &headers[0]); 
+        status[1] = FLASH_STORAGE_NO_FAT_FOUND; 
+        if(!(status[0] == FLASH_STORAGE_OK && headers[0].units == 1) && _fat_addr + 2*_erase_size < _area_end){
+            status[1] = parseFAT(_fat_addr + _erase_size, false, &headers[1]); 
+            // a single unit table can't be in the second unit 
+            if(status[1] == FLASH_STORAGE_OK && headers[1].units != 2) status[1] = FLASH_STORAGE_FAT_CORRUPT; 
+        }
+        // take the newest valid table 
+        int pick = -1; 
+        if(status[0] == FLASH_STORAGE_OK) pick = 0; 
+        if(status[1] == FLASH_STORAGE_OK && (pick < 0 || (long)(headers[1].sequence - headers[0].sequence) > 0)) pick = 1; 
+        if(pick < 0){
+            // written by a different array, don't interpret it 
+            if(status[0] == FLASH_STORAGE_INVALID_CONFIG || status[1] == FLASH_STORAGE_INVALID_CONFIG) found = FLASH_STORAGE_INVALID_CONFIG; 
+            else if(status[0] == FLASH_STORAGE_FAT_CORRUPT || status[1] == FLASH_STORAGE_FAT_CORRUPT) found = FLASH_STORAGE_FAT_CORRUPT; 
+            else if(status[0] != FLASH_STORAGE_NO_FAT_FOUND && found != FLASH_STORAGE_FAT_CORRUPT) found = status[0]; 
+            continue; 
+        }
+        _fat_active = pick; 
+        _fat_units = headers[pick].units; 
+        _fat_sequence = headers[pick].sequence; 
+        parseFAT(_fat_addr + pick*_erase_size, true, &headers[pick]); 
+        // regions reserved when the table was written stay out of the file area 
+        if(headers[pick].area_end > _fat_addr && headers[pick].area_end < _area_end) _area_end = headers[pick].area_end; 
+        found = FLASH_STORAGE_OK; 
+        // pick up the calibrated clocks kept next to the FAT 
+        readCalibration(); 
+        // a file left open needs its end restored 
+        unsigned int open_file = headers[pick].in_progress; 
+        if(open_file != 0 && open_file <= _fat.file_count && !_fat.files[open_file-1].is_inline){
+            recoverFile(open_file, headers[pick].area_end); 
+        }
+    }
+    _read_pinned = false; 
+    if(found != FLASH_STORAGE_OK){
+        // a new table uses alternating units if the area has room 
+        _read_device = 0; 
+        _fat.file_count = 0; 
+        _fat_active = 0; 
+        _fat_sequence = 0; 
+        _fat_units = (_fat_addr + (FLASH_STORAGE_FAT_UNITS + 1)*_erase_size <= _area_end) ? FLASH_STORAGE_FAT_UNITS : 1; 
+    }
+    _recovery_time = timeMicros() - start; 
+    return found; 
+}
+
+FlashStorage_status_t FlashStorage::parseFAT(unsigned long addr, bool apply, FlashStorageFATHeader* header){
     // read for the fat table 
     char id_string[] = FLASH_STORAGE_IDENTIFICATION_STRING;
     unsigned int read_size = sizeof(id_string)/sizeof(char); 
-    byte buff[read_size]; 
-    _flash_status = _flash.readData(0, buff, read_size);  
-    if(_flash_status != W25Q64_OK){
-        // check that its not a busy 
-        if(_flash_status == W25Q64_BUSY) return FLASH_STORAGE_BUSY; 
-        return FLASH_STORAGE_FLASH_FAIL; 
-    }
+    byte buff[sizeof(id_string)]; 
+    _status = readData(addr, buff, read_size);  
+    if(_status != FLASH_STORAGE_OK) return _status; 
     // compare 
-    if(strcmp(id_string, (char*)buff) == 0){
-        // id matches, read for data 
-        // first get the file length 
-        byte header[2]; 
-        _flash_status = _flash.readData(read_size, header, 2); 
-        // extrapolate the FAT size 
+    if(strcmp(id_string, (char*)buff) != 0) return FLASH_STORAGE_NO_FAT_FOUND; 
+    // id matches, read for data 
+    // first get the header 
+    byte fields[FLASH_STORAGE_FAT_HEADER_SIZE]; 
+    readData(addr + read_size, fields, FLASH_STORAGE_FAT_HEADER_SIZE); 
+    if(fields[0] != FLASH_STORAGE_FAT_VERSION){
+        // version 1 table, fields[0] is the file count 
+        if(fields[0] >= FLASH_STORAGE_MAX_FILE_NUMBER) return FLASH_STORAGE_FAT_CORRUPT; 
+        header->file_count = fields[0]; 
+        header->in_progress = 0; 
+        header->units = 1; 
+        header->sequence = 0; 
+        header->area_end = 0; 
+        if(!apply) return FLASH_STORAGE_OK; 
         // FAT size is file_count * (2 bytes for start page + 2 bytes for end page + 1 byte for page offset)
-        unsigned int fat_len = header[0]*5; 
-        byte fat_contents[fat_len]; 
-        _flash_status = _flash.readData(read_size + 2, fat_contents, fat_len); 
-        // construct the FAT 
-        for(int i = 0; i < header[0]; i ++){
-            _fat.files[i].start_addr = (fat_contents[i*5] << 8 | fat_contents[i*5+1])<<8; 
-            _fat.files[i].end_addr = (fat_contents[i*5+2] << 8 | fat_contents[i*5+3])<<8 + fat_contents[i*5+4]; 
+        // construct the FAT an entry at a time 
+        for(int i = 0; i < fields[0]; i ++){
+            byte entry[5]; 
+            readData(addr + read_size + 2 + i*5, entry, 5); 
+            _fat.files[i].start_addr = ((unsigned long)entry[0] << 8 | entry[1]) << 8; 
+            _fat.files[i].end_addr = (((unsigned long)entry[2] << 8 | entry[3]) << 8) + entry[4]; 
+            _fat.files[i].is_inline = false; 
         }
         // set the file count 
-        _fat.file_count = header[0]; 
-        // TODO implement the potential data corruption check 
-        // return success 
-        return FLASH_STORAGE_OK;   
+        _fat.file_count = fields[0]; 
+        return FLASH_STORAGE_OK; 
     }
-    _fat.file_count = 0; 
-    // no FAT table found 
-    // report as such 
-    return FLASH_STORAGE_NO_FAT_FOUND; 
+    // version 2 table, check the layout and the crc 
+    unsigned int file_count = fields[1]; 
+    if(file_count >= FLASH_STORAGE_MAX_FILE_NUMBER) return FLASH_STORAGE_FAT_CORRUPT; 
+    // the device sizes follow the header 
+    unsigned long sizes_addr = addr + read_size + FLASH_STORAGE_FAT_HEADER_SIZE; 
+    unsigned int fat_size = read_size + FLASH_STORAGE_FAT_HEADER_SIZE + fields[4]*FLASH_STORAGE_FAT_DEVICE_SIZE + file_count*FLASH_STORAGE_FAT_ENTRY_SIZE; 
+    // the inline data length follows the entries 
+    byte pool_header[2]; 
+    readData(addr + fat_size, pool_header, 2); 
+    unsigned int pool_size = (unsigned int)pool_header[0] << 8 | pool_header[1]; 
+    if(pool_size > FLASH_STORAGE_INLINE_POOL_SIZE) return FLASH_STORAGE_FAT_CORRUPT; 
+    fat_size += 2 + pool_size; 
+    // checksum the table a chunk at a time 
+    byte chunk[FLASH_STORAGE_FAT_CHUNK_SIZE]; 
+    unsigned int crc = 0xFFFF; 
+    for(unsigned int offset = 0; offset < fat_size; offset += FLASH_STORAGE_FAT_CHUNK_SIZE){
+        unsigned int size = (fat_size - offset > FLASH_STORAGE_FAT_CHUNK_SIZE) ? FLASH_STORAGE_FAT_CHUNK_SIZE : fat_size - offset; 
+        readData(addr + offset, chunk, size); 
+        crc = crc16(chunk, size, crc); 
+    }
+    readData(addr + fat_size, chunk, 2); 
+    if(((unsigned int)chunk[0] << 8 | chunk[1]) != crc) return FLASH_STORAGE_FAT_CORRUPT; 
+    if(fields[3] != _array_mode || fields[4] != _device_count) return FLASH_STORAGE_INVALID_CONFIG; 
+    // devices of another size give a different address layout, e.g. a concatenated array mounted with the default sizes 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        readData(sizes_addr + d*FLASH_STORAGE_FAT_DEVICE_SIZE, chunk, FLASH_STORAGE_FAT_DEVICE_SIZE); 
+        unsigned long size = (unsigned long)chunk[0] << 24 | (unsigned long)chunk[1] << 16 | (unsigned long)chunk[2] << 8 | chunk[3]; 
+        if(size != _device_size[d]) return FLASH_STORAGE_INVALID_CONFIG; 
+    }
+    header->file_count = file_count; 
+    header->in_progress = fields[2]; 
+    header->units = fields[5]; 
+    header->sequence = (unsigned long)fields[6] << 24 | (unsigned long)fields[7] << 16 | (unsigned long)fields[8] << 8 | fields[9]; 
+    header->area_end = (unsigned long)fields[10] << 24 | (unsigned long)fields[11] << 16 | (unsigned long)fields[12] << 8 | fields[13]; 
+    if(header->units == 0 || header->units > FLASH_STORAGE_FAT_UNITS) return FLASH_STORAGE_FAT_CORRUPT; 
+    if(!apply) return FLASH_STORAGE_OK; 
+    // construct the FAT, as many entries per read as fit in a chunk 
+    unsigned long entry_addr = sizes_addr + _device_count*FLASH_STORAGE_FAT_DEVICE_SIZE; 
+    unsigned int per_chunk = FLASH_STORAGE_FAT_CHUNK_SIZE / FLASH_STORAGE_FAT_ENTRY_SIZE; 
+    for(unsigned int i = 0; i < file_count; i ++){
+        if(i % per_chunk == 0){
+            unsigned int count = (file_count - i > per_chunk) ? per_chunk : file_count - i; 
+            readData(entry_addr + i*FLASH_STORAGE_FAT_ENTRY_SIZE, chunk, count*FLASH_STORAGE_FAT_ENTRY_SIZE); 
+        }
+        byte* entry = &chunk[(i % per_chunk)*FLASH_STORAGE_FAT_ENTRY_SIZE]; 
+        _fat.files[i].start_addr = (unsigned long)entry[0] << 24 | (unsigned long)entry[1] << 16 | (unsigned long)entry[2] << 8 | entry[3]; 
+        _fat.files[i].end_addr = (unsigned long)entry[4] << 24 | (unsigned long)entry[5] << 16 | (unsigned long)entry[6] << 8 | entry[7]; 
+        _fat.files[i].is_inline = (_fat.files[i].start_addr & FLASH_STORAGE_FAT_INLINE_FLAG) != 0; 
+        _fat.files[i].start_addr &= ~FLASH_STORAGE_FAT_INLINE_FLAG; 
+    }
+    // the inline data follows the entries and its length 
+    readData(entry_addr + file_count*FLASH_STORAGE_FAT_ENTRY_SIZE + 2, _fat.inline_data, pool_size); 
+    // set the file count 
+    _fat.file_count = file_count; 
+    return FLASH_STORAGE_OK; 
 }
 
 FlashStorage_status_t FlashStorage::writeFAT(){
     // write the _fat table 
     // first request an erase 
-    unsigned long start = millis(); 
-    if(_flash.busy()) return FLASH_STORAGE_BUSY; 
-    _flash.writeEnable(); 
-    _flash.sectorErase(0); 
-    // get the buffer length 
+    if(!_files_mounted) return FLASH_STORAGE_WRONG_MODE; 
+    if(busy()) return FLASH_STORAGE_BUSY; 
+    // alternate the units so the previous table survives a power loss until this one is complete 
+    unsigned int unit = (_fat_units > 1) ? 1 - _fat_active : 0; 
+    unsigned long addr = _fat_addr + unit*_erase_size; 
+    _fat_sequence ++; 
+    eraseUnit(addr); 
+    // encode the table a chunk at a time, programData waits for the erase to finish before the first one 
     char id_string[] = FLASH_STORAGE_IDENTIFICATION_STRING;
     unsigned int id_size = sizeof(id_string)/sizeof(char); 
-    unsigned int header_size = id_size + 2; // this is fixed for now 
-    unsigned int fat_size = header_size + _fat.file_count * 5; 
-    byte buff[fat_size];  
-    strcpy((char*)buff, id_string); 
-    buff[id_size] = _fat.file_count; 
-    buff[id_size + 1] = _opened_file; 
-    for(int i = 0; i < _fat.file_count; i ++){
-        buff[header_size + i*5] = _fat.files[i].start_addr>>16; 
-        buff[header_size + i*5 + 1] = _fat.files[i].start_addr>>8; 
-        buff[header_size + i*5 + 2] = _fat.files[i].end_addr>>16; 
-        buff[header_size + i*5 + 3] = _fat.files[i].end_addr>>8; 
-        buff[header_size + i*5 + 4] = _fat.files[i].end_addr; 
-        /*
-        Serial.print("File "); 
-        Serial.print(i + 1); 
-        Serial.print(" End Addr: "); 
-        Serial.println(_fat.files[i].end_addr); 
-        */ 
-    }
-    // perform the write action 
-    // wait until free now
-    for(int p = 0; p < 1 + fat_size/256; p ++){ 
-        // wait until free 
-        while(_flash.busy()); 
-        // enable write 
-        _flash.writeEnable(); 
-        // check the size, can only write up to a page 
-        int size = fat_size - p*256;
-        if(size < 0) size += 256; 
-        if(size > 256) size = 256; 
-        _flash.pageProgram(0, &buff[p*256], size); 
-        // Serial.println(size); 
-    } 
+    unsigned int pool_size = inlineUsed(); 
+    FlashStorageFATStream stream; 
+    stream.addr = addr; 
+    stream.fill = 0; 
+    stream.crc = 0xFFFF; 
+    _status = streamFAT(&stream, (byte*)id_string, id_size); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    byte fields[FLASH_STORAGE_FAT_HEADER_SIZE]; 
+    fields[0] = FLASH_STORAGE_FAT_VERSION; 
+    fields[1] = _fat.file_count; 
+    fields[2] = _opened_file; 
+    fields[3] = _array_mode; 
+    fields[4] = _device_count; 
+    fields[5] = _fat_units; 
+    fields[6] = _fat_sequence >> 24; 
+    fields[7] = _fat_sequence >> 16; 
+    fields[8] = _fat_sequence >> 8; 
+    fields[9] = _fat_sequence; 
+    fields[10] = _area_end >> 24; 
+    fields[11] = _area_end >> 16; 
+    fields[12] = _area_end >> 8; 
+    fields[13] = _area_end; 
+    _status = streamFAT(&stream, fields, FLASH_STORAGE_FAT_HEADER_SIZE); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        byte size[FLASH_STORAGE_FAT_DEVICE_SIZE]; 
+        size[0] = _device_size[d] >> 24; 
+        size[1] = _device_size[d] >> 16; 
+        size[2] = _device_size[d] >> 8; 
+        size[3] = _device_size[d]; 
+        _status = streamFAT(&stream, size, FLASH_STORAGE_FAT_DEVICE_SIZE); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
+    }
+    for(unsigned int i = 0; i < _fat.file_count; i ++){
+        byte entry[FLASH_STORAGE_FAT_ENTRY_SIZE]; 
+        unsigned long start_addr = _fat.files[i].start_addr; 
+        if(_fat.files[i].is_inline) start_addr |= FLASH_STORAGE_FAT_INLINE_FLAG; 
+        entry[0] = start_addr>>24; 
+        entry[1] = start_addr>>16; 
+        entry[2] = start_addr>>8; 
+        entry[3] = start_addr; 
+        entry[4] = _fat.files[i].end_addr>>24; 
+        entry[5] = _fat.files[i].end_addr>>16; 
+        entry[6] = _fat.files[i].end_addr>>8; 
+        entry[7] = _fat.files[i].end_addr; 
+        _status = streamFAT(&stream, entry, FLASH_STORAGE_FAT_ENTRY_SIZE); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
+    }
+    byte pool_header[2]; 
+    pool_header[0] = pool_size >> 8; 
+    pool_header[1] = pool_size; 
+    _status = streamFAT(&stream, pool_header, 2); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    _status = streamFAT(&stream, _fat.inline_data, pool_size); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    unsigned int crc = stream.crc; 
+    byte crc_bytes[2]; 
+    crc_bytes[0] = crc >> 8; 
+    crc_bytes[1] = crc; 
+    _status = streamFAT(&stream, crc_bytes, 2); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    // program the last chunk 
+    _status = flushFAT(&stream); 
+    if(_status != FLASH_STORAGE_OK) return _status; 
+    _fat_active = unit; 
+    // the calibration record moves with the table 
+    if(_clock_calibrated) writeCalibration(); 
+    return FLASH_STORAGE_OK; 
+}
 
-    unsigned long end = millis(); 
-    //Serial.print("Write FAT took: ");
-    //Serial.print(end-start); 
-    //Serial.println(" ms"); 
+FlashStorage_status_t FlashStorage::streamFAT(FlashStorageFATStream* stream, byte* data, unsigned int length){
+    stream->crc = crc16(data, length, stream->crc); 
+    while(length > 0){
+        unsigned int size = FLASH_STORAGE_FAT_CHUNK_SIZE - stream->fill; 
+        if(size > length) size = length; 
+        memcpy(&stream->chunk[stream->fill], data, size); 
+        stream->fill += size; 
+        data += size; 
+        length -= size; 
+        // chunks divide a page, so each one is a single program 
+        if(stream->fill == FLASH_STORAGE_FAT_CHUNK_SIZE){
+            _status = flushFAT(stream); 
+            if(_status != FLASH_STORAGE_OK) return _status; 
+        }
+    }
     return FLASH_STORAGE_OK; 
 }
 
+FlashStorage_status_t FlashStorage::flushFAT(FlashStorageFATStream* stream){
+    if(stream->fill == 0) return FLASH_STORAGE_OK; 
+    _status = programData(stream->addr, stream->chunk, stream->fill); 
+    stream->addr += stream->fill; 
+    stream->fill = 0; 
+    return _status; 
+}
+
+FlashStorage_status_t FlashStorage::eraseThrough(unsigned long end){
+    if(end > _area_end) end = _area_end; 
+    while(end > _max_erased_addr){
+        if(_max_erased_addr >= _area_end) return FLASH_STORAGE_NO_SPACE; 
+        eraseUnit(_max_erased_addr); 
+        _max_erased_addr += _erase_size; 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::eraseAhead(){
+    // a lookahead of several units needs several erases, stop at the first unit whose devices are still busy 
+    while(lookaheadNeeded()){
+        _status = eraseNextSector(); 
+        if(_status != FLASH_STORAGE_OK) return _status; 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+bool FlashStorage::lookaheadNeeded(){
+    // a completed reserve() covers the file, no erases until the write position leaves it 
+    if(_max_erased_addr >= _reserve_addr && _curr_addr < _reserve_addr) return false; 
+    return _curr_addr + _buff_index + FLASH_STORAGE_PAGE_SIZE + _lookahead_erase_size > _max_erased_addr; 
+}
+
 FlashStorage_status_t FlashStorage::eraseNextSector(){
     // erase the next sector 
-    // check if busy 
-    if(_flash.busy()) return FLASH_STORAGE_BUSY; 
+    // check if busy, only the devices backing the next unit matter 
+    if(unitBusy(_max_erased_addr)) return FLASH_STORAGE_BUSY; 
+    if(_max_erased_addr >= _area_end) return FLASH_STORAGE_NO_SPACE; 
     // erase at next place 
-    _flash.writeEnable(); 
-    _flash.sectorErase(_max_erased_addr); 
-    _max_erased_addr += 4096; 
+    eraseUnit(_max_erased_addr); 
+    _max_erased_addr += _erase_size; 
     return FLASH_STORAGE_OK; 
-}
\ No newline at end of file
+}
+
+unsigned int FlashStorage::crc16(byte* buff, unsigned int length, unsigned int crc){
+    // CRC-16/CCITT, bitwise to avoid a lookup table 
+    for(unsigned int i = 0; i < length; i ++){
+        crc ^= (unsigned int)buff[i] << 8; 
+        for(int b = 0; b < 8; b ++){
+            if(crc & 0x8000) crc = (crc << 1) ^ 0x1021; 
+            else crc = crc << 1; 
+        }
+    }
+    return crc & 0xFFFF; 
+}
+
+bool FlashStorage::isErased(unsigned long addr, unsigned long length){
+    // reads fail while a program or erase is in flight 
+    waitForDevices(); 
+    // read in small pieces to keep the stack down 
+    byte buff[32]; 
+    // every mirror has to be blank, a power cut between the mirror programs leaves the copies different 
+    unsigned int copies = (_array_mode == FLASH_STORAGE_ARRAY_MIRRORED) ? _device_count : 1; 
+    for(unsigned int c = 0; c < copies; c ++){
+        for(unsigned long offset = 0; offset < length; offset += sizeof(buff)){
+            unsigned int size = (length - offset > sizeof(buff)) ? sizeof(buff) : length - offset; 
+            if(copies > 1){
+                if(_flash[c].fastRead(addr + offset, buff, size) != W25Q64_OK) return false; 
+            }
+            else if(readData(addr + offset, buff, size) != FLASH_STORAGE_OK) return false; 
+            for(unsigned int i = 0; i < size; i ++){
+                if(buff[i] != 0xFF) return false; 
+            }
+        }
+    }
+    return true; 
+}
+
+unsigned int FlashStorage::inlineUsed(){
+    // inline data is appended in file order, the last inline file ends the pool 
+    for(int i = _fat.file_count - 1; i >= 0; i --){
+        if(_fat.files[i].is_inline) return _fat.files[i].end_addr; 
+    }
+    return 0; 
+}
+
+void FlashStorage::mapAddress(unsigned long addr, unsigned int* device, unsigned long* local){
+    if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED){
+        // same address on every device, report the first 
+        *device = 0; 
+        *local = addr; 
+        return; 
+    }
+    if(_array_mode == FLASH_STORAGE_ARRAY_CONCATENATED){
+        // walk the devices until the address falls inside one 
+        unsigned int d = 0; 
+        while(d + 1 < _device_count && addr >= _device_size[d]){
+            addr -= _device_size[d]; 
+            d ++; 
+        }
+        *device = d; 
+        *local = addr; 
+        return; 
+    }
+    // stripes (pages or ping pong regions) are placed round robin across the devices 
+    // for a single device this is the identity 
+    unsigned long stripe = addr / _stripe_size; 
+    *device = stripe % _device_count; 
+    *local = (stripe / _device_count) * _stripe_size + addr % _stripe_size; 
+}
+
+bool FlashStorage::busy(){
+    wakeDevices(); 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        if(_flash[d].busy()) return true; 
+    }
+    return false; 
+}
+
+void FlashStorage::waitForDevice(unsigned int device){
+    wakeDevices(); 
+    unsigned long* estimate = NULL; 
+    if(_op_type[device] == FLASH_STORAGE_OP_PROGRAM) estimate = &_program_time[device]; 
+    else if(_op_type[device] == FLASH_STORAGE_OP_ERASE) estimate = &_erase_time[device]; 
+    // sleep until the predicted completion, no bus traffic in the meantime 
+    bool slept = false; 
+    if(estimate != NULL){
+        unsigned long elapsed = timeMicros() - _op_start[device]; 
+        if(elapsed < *estimate){
+            yieldBus(); 
+            elapsed = timeMicros() - _op_start[device]; 
+            if(elapsed < *estimate) sleepMicros(*estimate - elapsed); 
+            slept = true; 
+        }
+    }
+    // then poll with backoff 
+    unsigned long step = FLASH_STORAGE_POLL_MIN_US; 
+    bool was_busy = false; 
+    while(true){
+        _status_reads ++; 
+        if(!_flash[device].busy()) break; 
+        was_busy = true; 
+        yieldBus(); 
+        sleepMicros(step); 
+        if(step < FLASH_STORAGE_POLL_MAX_US) step *= 2; 
+    }
+    if(estimate != NULL){
+        if(was_busy){
+            // learn the measured time, overshoot is at most one backoff step 
+            unsigned long elapsed = timeMicros() - _op_start[device]; 
+            *estimate = (*estimate * 7 + elapsed) / 8; 
+        }
+        else if(slept){
+            // done by the predicted time, it may have finished earlier 
+            *estimate -= *estimate / 16; 
+        }
+    }
+    _op_type[device] = FLASH_STORAGE_OP_NONE; 
+}
+
+void FlashStorage::waitForDevices(){
+    for(unsigned int d = 0; d < _device_count; d ++){
+        waitForDevice(d); 
+    }
+}
+
+void FlashStorage::startOperation(unsigned int device, FlashStorageOperation op){
+    _op_type[device] = op; 
+    _op_start[device] = timeMicros(); 
+}
+
+void FlashStorage::yieldBus(){
+    if(_yield_callback != NULL) _yield_callback(_yield_context); 
+}
+
+unsigned long FlashStorage::timeMicros(){
+    if(_time_callback != NULL) return _time_callback(_time_context); 
+    return micros(); 
+}
+
+void FlashStorage::sleepMicros(unsigned long us){
+    if(_delay_callback != NULL){
+        _delay_callback(us, _time_context); 
+        return; 
+    }
+    if(us >= 1000){
+        delay(us / 1000); 
+        us %= 1000; 
+    }
+    delayMicroseconds(us); 
+}
+
+void FlashStorage::setMirrorVerify(bool verify){
+    _mirror_verify = verify; 
+}
+
+unsigned long FlashStorage::getMirrorMismatches(){
+    return _mirror_mismatches; 
+}
+
+unsigned long FlashStorage::getStatusReads(){
+    return _status_reads; 
+}
+
+FlashStorage_status_t FlashStorage::getOperationTimes(unsigned int device, unsigned long* program_us, unsigned long* erase_us){
+    if(device >= _device_count) return FLASH_STORAGE_INVALID_CONFIG; 
+    *program_us = _program_time[device]; 
+    *erase_us = _erase_time[device]; 
+    return FLASH_STORAGE_OK; 
+}
+
+bool FlashStorage::unitOnOneDevice(){
+    return _array_mode == FLASH_STORAGE_ARRAY_PING_PONG || _array_mode == FLASH_STORAGE_ARRAY_CONCATENATED; 
+}
+
+bool FlashStorage::unitBusy(unsigned long addr){
+    wakeDevices(); 
+    if(unitOnOneDevice()){
+        // the unit lives on a single device 
+        unsigned int device; 
+        unsigned long local; 
+        mapAddress(addr, &device, &local); 
+        return _flash[device].busy(); 
+    }
+    return busy(); 
+}
+
+FlashStorage_status_t FlashStorage::eraseUnit(unsigned long addr){
+    wakeDevices(); 
+    if(unitOnOneDevice()){
+        // the unit is a single sector on one device 
+        unsigned int device; 
+        unsigned long local; 
+        mapAddress(addr, &device, &local); 
+        waitForDevice(device); 
+        _flash[device].writeEnable(); 
+        _flash[device].sectorErase(local - local % FLASH_STORAGE_SECTOR_SIZE); 
+        startOperation(device, FLASH_STORAGE_OP_ERASE); 
+        return FLASH_STORAGE_OK; 
+    }
+    // the erase unit is the same sector on every device 
+    unsigned long sector = (addr / _erase_size) * FLASH_STORAGE_SECTOR_SIZE; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        // wait until this device is free, the others keep working 
+        waitForDevice(d); 
+        _flash[d].writeEnable(); 
+        _flash[d].sectorErase(sector); 
+        startOperation(d, FLASH_STORAGE_OP_ERASE); 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::programData(unsigned long addr, byte* buff, unsigned int length){
+    // must be performed in 256 byte chunks that don't cross a page 
+    unsigned int index = 0; 
+    while(index < length){
+        unsigned int size = FLASH_STORAGE_PAGE_SIZE - addr % FLASH_STORAGE_PAGE_SIZE; 
+        if(size > length - index) size = length - index; 
+        if(index > 0) yieldBus(); 
+        unsigned int device; 
+        unsigned long local; 
+        mapAddress(addr, &device, &local); 
+        if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED){
+            // program every copy, each only waits on its own device 
+            for(unsigned int d = 0; d < _device_count; d ++){
+                waitForDevice(d); 
+                programPage(d, local, &buff[index], size); 
+            }
+        }
+        else{
+            // wait until free 
+            waitForDevice(device); 
+            programPage(device, local, &buff[index], size); 
+        }
+        addr += size; 
+        index += size; 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+void FlashStorage::programPage(unsigned int device, unsigned long addr, byte* buff, unsigned int length){
+    wakeDevices(); 
+    // enable write 
+    _flash[device].writeEnable(); 
+    if(_program_callback != NULL && !_program_fallback[device]){
+        if(_program_callback(device, addr, buff, length, _program_context) == FLASH_STORAGE_OK){
+            startOperation(device, FLASH_STORAGE_OP_PROGRAM); 
+            return; 
+        }
+        // not supported on this device, the write enable is still latched 
+        _program_fallback[device] = true; 
+    }
+    _flash[device].pageProgram(addr, buff, length); 
+    startOperation(device, FLASH_STORAGE_OP_PROGRAM); 
+}
+
+FlashStorage_status_t FlashStorage::readData(unsigned long addr, byte* buff, unsigned int length){
+    wakeDevices(); 
+    if(_array_mode == FLASH_STORAGE_ARRAY_MIRRORED) return readMirrored(addr, buff, length); 
+    // read in runs that stay on one device 
+    unsigned int index = 0; 
+    while(index < length){
+        unsigned int size = length - index; 
+        unsigned int device; 
+        unsigned long local; 
+        mapAddress(addr, &device, &local); 
+        if(_array_mode == FLASH_STORAGE_ARRAY_CONCATENATED){
+            // stop at the end of this device 
+            if(size > _device_size[device] - local) size = _device_size[device] - local; 
+        }
+        else if(_device_count > 1){
+            unsigned long stripe_remaining = _stripe_size - addr % _stripe_size; 
+            if(size > stripe_remaining) size = stripe_remaining; 
+        }
+        // bound the bus hold time, let the other devices on the bus in between 
+        if(_bus_chunk != 0 && size > _bus_chunk) size = _bus_chunk; 
+        if(index > 0) yieldBus(); 
+        // perform a fast read 
+        _flash_status = _flash[device].fastRead(local, &buff[index], size); 
+        if(_flash_status != W25Q64_OK){
+            // check that its not a busy 
+            if(_flash_status == W25Q64_BUSY) return FLASH_STORAGE_BUSY; 
+            return FLASH_STORAGE_FLASH_FAIL; 
+        }
+        addr += size; 
+        index += size; 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+FlashStorage_status_t FlashStorage::readMirrored(unsigned long addr, byte* buff, unsigned int length){
+    // start on an idle mirror if the preferred one is busy 
+    unsigned int start = _read_device; 
+    for(unsigned int d = 0; d < _device_count && !_read_pinned; d ++){
+        if(!_flash[(_read_device + d) % _device_count].busy()){
+            start = (_read_device + d) % _device_count; 
+            break; 
+        }
+    }
+    // the next read starts on the next mirror 
+    if(!_read_pinned) _read_device = (start + 1) % _device_count; 
+    unsigned int index = 0; 
+    while(index < length){
+        unsigned int size = length - index; 
+        if(_bus_chunk != 0 && size > _bus_chunk) size = _bus_chunk; 
+        if(index > 0) yieldBus(); 
+        // try the other copies if this one fails 
+        FlashStorage_status_t status = FLASH_STORAGE_FLASH_FAIL; 
+        unsigned int device = start; 
+        for(unsigned int attempt = 0; attempt < _device_count && status != FLASH_STORAGE_OK; attempt ++){
+            device = (start + attempt) % _device_count; 
+            _flash_status = _flash[device].fastRead(addr, &buff[index], size); 
+            if(_flash_status == W25Q64_OK) status = FLASH_STORAGE_OK; 
+            else if(_flash_status == W25Q64_BUSY) status = FLASH_STORAGE_BUSY; 
+        }
+        if(status != FLASH_STORAGE_OK) return status; 
+        // the FAT copies are checked one by one on their own 
+        if(_mirror_verify && !_read_pinned) verifyMirrors(device, addr, &buff[index], size); 
+        addr += size; 
+        index += size; 
+    }
+    return FLASH_STORAGE_OK; 
+}
+
+void FlashStorage::verifyMirrors(unsigned int source, unsigned long addr, byte* buff, unsigned int length){
+    byte copy[FLASH_STORAGE_MIRROR_COMPARE_SIZE]; 
+    bool mismatch = false; 
+    for(unsigned int d = 0; d < _device_count; d ++){
+        if(d == source) continue; 
+        unsigned int index = 0; 
+        while(index < length){
+            unsigned int size = length - index; 
+            if(size > sizeof(copy)) size = sizeof(copy); 
+            if(_bus_chunk != 0 && size > _bus_chunk) size = _bus_chunk; 
+            yieldBus(); 
+            // a busy or failing mirror is left out 
+            if(_flash[d].fastRead(addr + index, copy, size) != W25Q64_OK) break; 
+            for(unsigned int i = 0; i < size; i ++){
+                if(buff[index + i] == copy[i]) continue; 
+                // programs and charge loss only set bits, the AND is what was written 
+                buff[index + i] &= copy[i]; 
+                mismatch = true; 
+            }
+            index += size; 
+        }
+    }
+    if(mismatch) _mirror_mismatches ++; 
+}
+
+FlashStorage_status_t FlashStorageBufferPool::init(byte* memory, unsigned int size){
+    _memory = memory; 
+    _block_count = size / FLASH_STORAGE_PAGE_SIZE; 
+    if(_block_count > FLASH_STORAGE_POOL_MAX_BLOCKS) _block_count = FLASH_STORAGE_POOL_MAX_BLOCKS; 
+    _used = 0; 
+    if(memory == NULL || _block_count == 0) return FLASH_STORAGE_INVALID_CONFIG; 
+    return FLASH_STORAGE_OK; 
+}
+
+byte* FlashStorageBufferPool::acquire(unsigned int blocks, unsigned int min_blocks, unsigned int* acquired){
+    // find the longest free run, stop at the first one that is long enough 
+    unsigned int best_start = 0; 
+    unsigned int best_length = 0; 
+    unsigned int run_start = 0; 
+    unsigned int run_length = 0; 
+    for(unsigned int b = 0; b < _block_count && best_length < blocks; b ++){
+        if(_used & (1UL << b)){
+            run_length = 0; 
+            continue; 
+        }
+        if(run_length == 0) run_start = b; 
+        run_length ++; 
+        if(run_length > best_length){
+            best_start = run_start; 
+            best_length = run_length; 
+        }
+    }
+    if(best_length > blocks) best_length = blocks; 
+    if(best_length == 0 || best_length < min_blocks) return NULL; 
+    for(unsigned int b = best_start; b < best_start + best_length; b ++) _used |= 1UL << b; 
+    *acquired = best_length; 
+    return &_memory[best_start * FLASH_STORAGE_PAGE_SIZE]; 
+}
+
+void FlashStorageBufferPool::release(byte* buff, unsigned int blocks){
+    // only runs this pool handed out 
+    if(_memory == NULL || buff < _memory || buff >= &_memory[_block_count * FLASH_STORAGE_PAGE_SIZE]) return; 
+    if((buff - _memory) % FLASH_STORAGE_PAGE_SIZE != 0) return; 
+    unsigned int start = (buff - _memory) / FLASH_STORAGE_PAGE_SIZE; 
+    for(unsigned int b = start; b < start + blocks && b < _block_count; b ++) _used &= ~(1UL << b); 
+}
+
+unsigned int FlashStorageBufferPool::available(){
+    unsigned int count = 0; 
+    for(unsigned int b = 0; b < _block_count; b ++){
+        if(!(_used & (1UL << b))) count ++; 
+    }
+    return count; 
+}
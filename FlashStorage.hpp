@@ -17,12 +17,58 @@
 // includes 
 #include <Arduino.h> 
 #include "./lib/W25Q64/W25Q64.hpp"
+#include "FlashStorageConfig.hpp" 
 
 // pre-definitions
 #define FLASH_STORAGE_IDENTIFICATION_STRING "FLASH"
-#define FLASH_STORAGE_FIFO_BUFFER_SIZE 1024 
-#define FLASH_STORAGE_MAX_FILE_NUMBER 32  
+#define FLASH_STORAGE_POOL_MAX_BLOCKS 32 
 #define FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE 1024 
+#define FLASH_STORAGE_MAX_LOOKAHEAD_SIZE 0x20000 // limit for setLookahead() and the auto tuner 
+#define FLASH_STORAGE_PAGE_SIZE 256 
+#define FLASH_STORAGE_SECTOR_SIZE 4096 
+#define FLASH_STORAGE_DEVICE_SIZE 0x800000 // W25Q64, 8 MB 
+#define FLASH_STORAGE_W25Q128_SIZE 0x1000000 // 16 MB 
+#define FLASH_STORAGE_MAX_DEVICE_SIZE FLASH_STORAGE_W25Q128_SIZE // limited by 3 byte addressing in the W25Q64 driver 
+#define FLASH_STORAGE_PING_PONG_REGION_SIZE 0x10000 // 64 KB, one block 
+#define FLASH_STORAGE_FAT_INLINE_FLAG 0x80000000 // set in a stored start address for inline files 
+#define FLASH_STORAGE_FAT_VERSION 0x82 // high bit set so it can't be mistaken for a version 1 file count 
+#define FLASH_STORAGE_FAT_HEADER_SIZE 14 // version, file count, in-progress file, array mode, device count, FAT units, 4 byte sequence, 4 byte area end 
+#define FLASH_STORAGE_FAT_UNITS 2 // FAT copies written in turn on new volumes 
+#define FLASH_STORAGE_FAT_DEVICE_SIZE 4 // size of each device, after the header 
+#define FLASH_STORAGE_FAT_ENTRY_SIZE 8 
+#define FLASH_STORAGE_PROGRAM_TIME_US 700 // starting estimate of a page program, learned per device 
+#define FLASH_STORAGE_ERASE_TIME_US 45000 // starting estimate of a sector erase, learned per device 
+#define FLASH_STORAGE_POLL_MIN_US 8 // first backoff step once the predicted time has passed 
+#define FLASH_STORAGE_POLL_MAX_US 512 // largest backoff step 
+#define FLASH_STORAGE_READ_OVERHEAD 5 // fast read command, 3 address bytes and a dummy byte 
+#define FLASH_STORAGE_MIRROR_COMPARE_SIZE 32 // the other mirrors are read back in pieces of this size 
+#define FLASH_STORAGE_CLOCK_ID_0 'C' 
+#define FLASH_STORAGE_CLOCK_ID_1 'K' 
+#define FLASH_STORAGE_CALIBRATION_READS 8 // reads of the scratch page that must all match at a rate 
+#define FLASH_STORAGE_WAKE_TIME_US 3 // tRES1, release from deep power-down to the next command 
+#define FLASH_STORAGE_PROGRAM_MAX_US 3000 // worst case page program (tPP max) 
+#define FLASH_STORAGE_ERASE_MAX_US 400000 // worst case sector erase (tSE max) 
+#define FLASH_STORAGE_EOD_ID_0 'E' 
+#define FLASH_STORAGE_EOD_ID_1 'O' 
+#define FLASH_STORAGE_EOD_ID_2 'D' 
+#define FLASH_STORAGE_EOD_SIZE 10 // 3 byte id, file index, 4 byte end address, 2 byte crc 
+#define FLASH_STORAGE_TRACE_RECORD_SIZE 12 // op, 3 byte argument, 4 byte start time, 4 byte duration 
+#define FLASH_STORAGE_PARTITION_ID_STRING "FPART"
+#define FLASH_STORAGE_PARTITION_VERSION 1 
+#define FLASH_STORAGE_PARTITION_ENTRY_SIZE 9 // type, 4 byte start address, 4 byte size 
+#define FLASH_STORAGE_MAX_PARTITIONS 4 
+#define FLASH_STORAGE_PARTITION_TABLE_SIZE (sizeof(FLASH_STORAGE_PARTITION_ID_STRING) + 2 + FLASH_STORAGE_MAX_PARTITIONS*FLASH_STORAGE_PARTITION_ENTRY_SIZE + 2) // largest table with its crc 
+
+// checks on FlashStorageConfig.hpp 
+#if FLASH_STORAGE_FAT_CHUNK_SIZE < FLASH_STORAGE_FAT_ENTRY_SIZE || FLASH_STORAGE_PAGE_SIZE % FLASH_STORAGE_FAT_CHUNK_SIZE 
+#error "FLASH_STORAGE_FAT_CHUNK_SIZE must divide FLASH_STORAGE_PAGE_SIZE and hold a FAT entry" 
+#endif 
+#if FLASH_STORAGE_FIFO_BUFFER_SIZE % FLASH_STORAGE_PAGE_SIZE 
+#error "FLASH_STORAGE_FIFO_BUFFER_SIZE must be a multiple of FLASH_STORAGE_PAGE_SIZE" 
+#endif 
+#if FLASH_STORAGE_MAX_FILE_NUMBER > 255 
+#error "FLASH_STORAGE_MAX_FILE_NUMBER must fit the 1 byte file count of the FAT" 
+#endif 
 
 
 typedef enum{
@@ -32,18 +78,58 @@ typedef enum{
     FLASH_STORAGE_NO_FAT_FOUND, 
     FLASH_STORAGE_NO_SPACE,
     FLASH_STORAGE_INVALID_FILE,
-    FLASH_STORAGE_WRONG_MODE  
+    FLASH_STORAGE_WRONG_MODE,
+    FLASH_STORAGE_INVALID_CONFIG,
+    FLASH_STORAGE_FAT_CORRUPT,
+    FLASH_STORAGE_NOT_FOUND  
 } FlashStorage_status_t; 
 
+/**
+ * @brief application supplied page program, e.g. Quad Input Page Program (0x32) on a quad capable bus 
+ * 
+ * Called with write enable already latched. Must issue a single program of at most one page and not wait for it to finish. 
+ * Returning anything but FLASH_STORAGE_OK before sending the command makes the device fall back to the standard page 
+ * program for good. 
+ */
+typedef FlashStorage_status_t (*FlashStorage_program_callback_t)(unsigned int device, unsigned long addr, byte* buff, unsigned int length, void* context); 
+
+/**
+ * @brief application supplied bus yield, called whenever FlashStorage releases the shared SPI bus between transfers 
+ * 
+ * Other devices on the bus can be serviced from here. Must not use the flash chips. 
+ */
+typedef void (*FlashStorage_yield_callback_t)(void* context); 
+
+/**
+ * @brief application supplied SPI clock setter, used for every transfer to the device until called again 
+ */
+typedef void (*FlashStorage_clock_callback_t)(unsigned int device, unsigned long hz, void* context); 
+
+/**
+ * @brief application supplied power control, sends Deep Power-down (0xB9) or Release Power-down (0xAB) to a device 
+ */
+typedef void (*FlashStorage_power_callback_t)(unsigned int device, bool wake, void* context); 
+
+/**
+ * @brief application supplied time source in microseconds, replaces micros() 
+ */
+typedef unsigned long (*FlashStorage_time_callback_t)(void* context); 
+
+/**
+ * @brief application supplied delay in microseconds, replaces delay() and delayMicroseconds() 
+ */
+typedef void (*FlashStorage_delay_callback_t)(unsigned long us, void* context); 
+
 struct FlashStorageFile{
     unsigned long start_addr; 
     unsigned long end_addr; 
+    bool is_inline; // addresses are offsets into FlashStorageFAT::inline_data 
 }; 
 
 
 /*
     FAT table implementation notes: 
-        FAT table is always found at the 0x00 addr 
+        FAT table is found at the 0x00 addr, or at the start of the mounted file partition when a partition table exists 
         FAT table will start with the FLASH_STORAGE_IDENTIFICATION_STRING. This is used to determine if there is actually a FAT table on the chip or not 
         The next byte is the file count (1 indexed) 
         The next byte is the in-progress file index (1 indexed). This is used to determine if a file was not properly closed out previously. This will be  
@@ -53,37 +139,268 @@ struct FlashStorageFile{
             2 bytes for the page length 
             1 byte for the page offset (the last written index). A 0 represents no data written to the last page (i.e. file contents ended on the previous page + 255 offset). A 255
 
+    Version 2 (FLASH_STORAGE_FAT_VERSION), always written now. Version 1 tables above are still read and are upgraded on 
+    the next FAT write: 
+        FLASH_STORAGE_IDENTIFICATION_STRING 
+        1 byte FLASH_STORAGE_FAT_VERSION, in place of the version 1 file count 
+        1 byte file count 
+        1 byte in-progress file index, set while a file is open for writing. A file still marked at init is recovered: 
+            the data after its recorded end is scanned page by page up to an end-of-data marker left by 
+            emergencyFlush() (on the first page boundary after the data) or the first blank page. 
+        1 byte array mode and 1 byte device count, a table written by a different array layout is rejected 
+        1 byte FAT unit count and a 4 byte sequence number, incremented with every FAT write 
+        4 byte end of the file area, less any reserveRegion(). Recovery of an in-progress file stops there, so it never 
+            runs into a region that was reserved when the file was opened (e.g. the KV store). init() restores it, so 
+            new files stay out of the region before it is reserved again 
+        Per device, 4 byte size in bytes as used by the array (the smallest size for striped, ping pong and mirrored 
+            arrays). A table written with other device sizes is rejected 
+        Per file, 4 byte start address and 4 byte end address, big endian. FLASH_STORAGE_FAT_INLINE_FLAG is set in the start 
+            address of inline files, their addresses are offsets into the inline data 
+        2 byte inline data length followed by the inline data 
+        2 byte CRC-16/CCITT over everything before it 
+    Full 32 bit addresses let the volume grow past 16 MB. 
+    With 2 units (volumes initialized since version 2) the table alternates between the first two erase units of the file 
+        area and files start after them. init() takes the valid table with the highest sequence, a power loss during a FAT 
+        write leaves the previous table intact. Volumes upgraded from version 1 keep their single unit until 
+        initializeFAT(), as the unit after it already holds file data. 
+    After calibrateClock() the last page of the current FAT unit holds the calibrated clocks, rewritten with every FAT: 
+        FLASH_STORAGE_CLOCK_ID_0, FLASH_STORAGE_CLOCK_ID_1, 1 byte device count, 4 byte rate (Hz) per device, 2 byte CRC 
+        The pages below it serve as the calibration scratch pages. 
 */
+struct FlashStorageFATHeader{
+    unsigned int file_count; 
+    unsigned int in_progress; // file open for writing, 0 if none 
+    unsigned int units; 
+    unsigned long sequence; 
+    unsigned long area_end; // end of the file area when the table was written, 0 for version 1 
+}; 
+
+/**
+ * @brief FAT being encoded, programmed a chunk at a time so the table never sits in RAM as a whole 
+ */
+struct FlashStorageFATStream{
+    unsigned long addr; // where the chunk goes 
+    unsigned int fill; 
+    unsigned int crc; // running crc of everything added 
+    byte chunk[FLASH_STORAGE_FAT_CHUNK_SIZE]; 
+}; 
+
 struct FlashStorageFAT{
     FlashStorageFile files[FLASH_STORAGE_MAX_FILE_NUMBER]; 
     unsigned int file_count; 
+    byte inline_data[FLASH_STORAGE_INLINE_POOL_SIZE]; // contents of inline files, in file order 
 }; 
 
+/*
+    Partition table implementation notes: 
+        Optional, found at the 0x00 addr in place of a FAT and owns the first erase unit. Without it the whole volume is one 
+            file area with its FAT at 0x00 (the original layout). 
+        FLASH_STORAGE_PARTITION_ID_STRING, 1 byte FLASH_STORAGE_PARTITION_VERSION, 1 byte partition count 
+        Per partition, 1 byte type, 4 byte start address, 4 byte size, big endian. Both are whole erase units. 
+        2 byte CRC-16/CCITT over everything before it 
+    Each file partition has its own FAT in its first erase unit and its own allocator, FAT writes stay inside the partition. 
+    KV partitions are handed to FlashKVStore, raw partitions (e.g. a black box ring buffer) are driven by the application 
+    through readRaw(), programRaw() and eraseRaw(). 
+*/
+typedef enum{
+    FLASH_STORAGE_PARTITION_FILES = 0, 
+    FLASH_STORAGE_PARTITION_KV, 
+    FLASH_STORAGE_PARTITION_RAW 
+} FlashStoragePartitionType; 
+
+struct FlashStoragePartition{
+    FlashStoragePartitionType type; 
+    unsigned long start_addr; 
+    unsigned long size; 
+}; 
+
+/*
+    Trace notes: 
+        With setTrace() every top level API call below is logged to an application supplied RAM ring, the oldest records 
+        are overwritten. Calls made inside another call (e.g. the close() in newFile()) are part of the outer record. 
+        These are all the calls that change the volume or the open file. Setup calls (the set...() functions, 
+        writePartitionTable(), calibrateClock()) are not traced, a replay starts from a volume set up the same way. 
+        Each record is FLASH_STORAGE_TRACE_RECORD_SIZE bytes, big endian: 
+            1 byte FlashStorageTraceOp 
+            3 byte argument: write/read/writeFile length, reserve/reserveRegion size, file index for openFile and 
+                openForAppend, partition index for mountPartition, 0 otherwise 
+            4 byte start time (us), 4 byte duration (us) 
+        replayTrace() issues the same calls with the same spacing, e.g. on a host build with a simulated driver and a 
+        virtual clock (setTimeCallbacks()) to compare configurations against a field workload. 
+        setWriteStats() keeps a power of 2 histogram of write() latencies, so each configuration replayed can be scored 
+        on p99 latency and throughput with getWriteStats(), next to its RAM use (sizeof(FlashStorage)). 
+*/
+typedef enum{
+    FLASH_STORAGE_TRACE_NEW_FILE = 1, 
+    FLASH_STORAGE_TRACE_WRITE, 
+    FLASH_STORAGE_TRACE_CLOSE, 
+    FLASH_STORAGE_TRACE_OPEN_FILE, 
+    FLASH_STORAGE_TRACE_READ, 
+    FLASH_STORAGE_TRACE_SYNC, 
+    FLASH_STORAGE_TRACE_WRITE_FILE, 
+    FLASH_STORAGE_TRACE_OPEN_FOR_APPEND, 
+    FLASH_STORAGE_TRACE_RESERVE, // blocking reserve() 
+    FLASH_STORAGE_TRACE_RESERVE_BACKGROUND, // reserve() with blocking false 
+    FLASH_STORAGE_TRACE_POLL, 
+    FLASH_STORAGE_TRACE_EMERGENCY_FLUSH, 
+    FLASH_STORAGE_TRACE_DELETE_LAST_FILE, 
+    FLASH_STORAGE_TRACE_DELETE_ALL_FILES, 
+    FLASH_STORAGE_TRACE_INITIALIZE_FAT, 
+    FLASH_STORAGE_TRACE_MOUNT_PARTITION, 
+    FLASH_STORAGE_TRACE_RESERVE_REGION 
+} FlashStorageTraceOp; 
+
+struct FlashStorageTraceRecord{
+    FlashStorageTraceOp op; 
+    unsigned long arg; 
+    unsigned long start_us; 
+    unsigned long duration_us; 
+}; 
+
+struct FlashStorageWriteStats{
+    unsigned long count; // write() calls 
+    unsigned long bytes; // bytes written 
+    unsigned long elapsed_us; // time since the stats were started 
+    unsigned long max_us; // slowest write() 
+    unsigned long p50_us; // median write() latency, upper bound of its bucket 
+    unsigned long p99_us; // 99th percentile write() latency, upper bound of its bucket 
+}; 
+
+typedef enum{
+    FLASH_STORAGE_OP_NONE = 0, 
+    FLASH_STORAGE_OP_PROGRAM, 
+    FLASH_STORAGE_OP_ERASE 
+} FlashStorageOperation; 
+
 typedef enum{
     FLASH_STORAGE_NO_MODE = 0, 
     FLASH_STORAGE_READ_MODE,
     FLASH_STORAGE_WRITE_MODE  
 } FlashStorageMode; 
 
+/*
+    Device array notes: 
+        All devices are presented as a single linear address space, the FAT and file addresses are in this space. 
+        FLASH_STORAGE_ARRAY_SINGLE uses one device. 
+        FLASH_STORAGE_ARRAY_STRIPED stripes pages across all devices (page p lives on device p % device_count). Consecutive 
+            page programs land on different chips and proceed in parallel. The erase unit grows to one sector on every 
+            device (device_count * 4096 bytes) so that erases also run in parallel. 
+        FLASH_STORAGE_ARRAY_PING_PONG alternates whole regions (FLASH_STORAGE_PING_PONG_REGION_SIZE) between devices. The 
+            erase lookahead is one region, so the next region is erased on the idle chip while the current chip absorbs 
+            page programs. The erase unit stays a single sector. Device sizes must be whole regions. 
+        FLASH_STORAGE_ARRAY_MIRRORED keeps an identical copy on every device. Programs and erases are issued to all devices 
+            back to back so they run in parallel. Successive reads rotate over the mirrors (the devices share one bus, so 
+            splitting a single read would not make it faster), a piece that fails on one copy is read from the next. Each 
+            piece is compared with the other copies, see setMirrorVerify(). The FAT is taken from the first copy with a 
+            valid identification string. 
+        FLASH_STORAGE_ARRAY_CONCATENATED places the devices one after the other, device sizes may differ. Addresses 
+            [0, size0) are on device 0, [size0, size0 + size1) on device 1 and so on. Device sizes are whole sectors, so 
+            pages and erase units never cross a device boundary. 
+        Striped, ping pong and mirrored arrays use the smallest device size for every device. 
+*/
+typedef enum{
+    FLASH_STORAGE_ARRAY_SINGLE = 0, 
+    FLASH_STORAGE_ARRAY_STRIPED,
+    FLASH_STORAGE_ARRAY_PING_PONG,
+    FLASH_STORAGE_ARRAY_MIRRORED,
+    FLASH_STORAGE_ARRAY_CONCATENATED 
+} FlashStorageArrayMode; 
+
+/*
+    Buffer notes: 
+        The write FIFO is FLASH_STORAGE_FIFO_BUFFER_SIZE bytes inside every FlashStorage. setBuffer() replaces it with 
+        application memory, setBufferPool() draws it from a FlashStorageBufferPool shared by several instances while a 
+        file is open for writing and gives it back on close(). Built with FLASH_STORAGE_FIFO_BUFFER_SIZE 0 there is no 
+        internal buffer and one of the two must be set before writing. 
+*/
+class FlashStorageBufferPool{
+public: 
+
+    /**
+     * @brief hand the pool its memory 
+     * 
+     * @param memory pool memory, split into FLASH_STORAGE_PAGE_SIZE blocks 
+     * @param size size of memory, up to FLASH_STORAGE_POOL_MAX_BLOCKS blocks are used 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if it holds no block 
+     */
+    FlashStorage_status_t init(byte* memory, unsigned int size); 
+
+    /**
+     * @brief take a run of consecutive blocks 
+     * 
+     * Takes the longest free run up to blocks, as long as it has at least min_blocks. 
+     * 
+     * @param blocks blocks wanted 
+     * @param min_blocks fewest blocks accepted 
+     * @param acquired set to the blocks taken 
+     * @return byte* start of the run, NULL if no run of min_blocks is free 
+     */
+    byte* acquire(unsigned int blocks, unsigned int min_blocks, unsigned int* acquired); 
+
+    /**
+     * @brief give a run back 
+     * 
+     * Ignored if buff is not the start of a block of this pool. 
+     * 
+     * @param buff start of the run 
+     * @param blocks blocks in the run 
+     */
+    void release(byte* buff, unsigned int blocks); 
+
+    /**
+     * @brief get the number of free blocks 
+     * 
+     * @return unsigned int free blocks 
+     */
+    unsigned int available(); 
+
+private: 
+    byte* _memory = NULL; 
+    unsigned int _block_count = 0; 
+    unsigned long _used = 0; // one bit per block 
+}; 
+
 class FlashStorage{
 public: 
 
+    /**
+     * @brief construct an unmounted FlashStorage 
+     * 
+     * Inline so that every file creating one references the configuration symbol of its own FlashStorageConfig.hpp sizes. 
+     */
+    FlashStorage(){ _config = &FLASH_STORAGE_CONFIG_SIGNATURE; } 
+
     /**
      * @brief initialize the FlashStorage class 
      * 
-     * Initializes the Flash Chip, checks for a FAT table. 
+     * Initializes the Flash Chip, checks for a partition table and a FAT table. With a partition table the first file 
+     * partition is mounted. 
      * 
      * @param cs_pin chip select pin for the Flash Chip 
      * @return FlashStorage_status_t 
      */
     FlashStorage_status_t init(int cs_pin); 
 
+    /**
+     * @brief initialize the FlashStorage class over several Flash Chips 
+     * 
+     * Initializes every Flash Chip and checks for a FAT table spanning the array. 
+     * 
+     * @param cs_pins chip select pins, one per Flash Chip 
+     * @param device_count number of Flash Chips (up to FLASH_STORAGE_MAX_DEVICES) 
+     * @param array_mode how the chips are combined into one address space 
+     * @param device_sizes size of each Flash Chip in bytes, NULL for all FLASH_STORAGE_DEVICE_SIZE 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if the FAT was written with another array mode, device 
+     * count or device sizes, or if it holds a partition table and was built without FLASH_STORAGE_PARTITIONS 
+     */
+    FlashStorage_status_t init(int* cs_pins, unsigned int device_count, FlashStorageArrayMode array_mode = FLASH_STORAGE_ARRAY_STRIPED, unsigned long* device_sizes = NULL); 
+
     /**
      * @brief initializes a blank FAT table on the flash chip 
      * 
      * Removes any reference to data on the chip by clearing the FAT tabl. 
      * 
-     * @return FlashStorage_status_t 
+     * @return FlashStorage_status_t FLASH_STORAGE_WRONG_MODE if the partition table has no file partition 
      */
     FlashStorage_status_t initializeFAT(); 
 
@@ -100,19 +417,204 @@ public:
     /**
      * @brief opens a new file for writing 
      * 
-     * Opens and records a new file in the FAT table. Erases the first sector to get ready for writing. 
+     * Opens and records a new file in the FAT table. The file starts on the page after the previous file. If the rest of 
+     * that erase unit is still blank no erase is needed, otherwise the file moves to the next erase unit and it is erased. 
      * 
-     * @return FlashStorage_status_t 
+     * @return FlashStorage_status_t FLASH_STORAGE_WRONG_MODE if the partition table has no file partition 
      */
     FlashStorage_status_t newFile(); 
 
     /**
-     * @brief opens a file for reading (not intended for appending for now) 
+     * @brief opens a new file for writing and pre-erases its expected extent 
+     * 
+     * Same as newFile() followed by a blocking reserve(size_hint). 
+     * 
+     * @param size_hint expected size of the file (bytes) 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t newFile(unsigned long size_hint); 
+
+    /**
+     * @brief erase ahead of the open file so later writes never wait on an erase 
+     * 
+     * Erases from the current erase frontier to cover the next bytes of the file. Blocking waits for every erase, 
+     * otherwise the erases are started one at a time by poll() (and by write() as usual). 
+     * 
+     * @param bytes number of bytes past the current write position to have erased 
+     * @param blocking wait for the erases to finish 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t reserve(unsigned long bytes, bool blocking = true); 
+
+    /**
+     * @brief advance a background reserve() 
+     * 
+     * Starts the next erase if the devices backing it are idle. Call regularly while a background reserve is pending. 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_BUSY while erases remain, FLASH_STORAGE_OK when done 
+     */
+    FlashStorage_status_t poll(); 
+
+    /**
+     * @brief get the progress of a reserve() 
+     * 
+     * @return unsigned long bytes that still need to be erased 
+     */
+    unsigned long getReserveRemaining(); 
+
+    /**
+     * @brief set how far ahead of the write position erases are started 
+     * 
+     * Larger values keep more sectors erased ahead of fast writers, bytes / getEraseSize() rounded up. Ping pong arrays 
+     * need at least a region. 
+     * 
+     * @param bytes lookahead distance, FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE up to FLASH_STORAGE_MAX_LOOKAHEAD_SIZE 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if out of range 
+     */
+    FlashStorage_status_t setLookahead(unsigned long bytes); 
+
+    /**
+     * @brief get how much of the lookahead is still to be erased 
+     * 
+     * write() leaves erases that would wait on a busy device to the next call, this reports what it left. 
+     * 
+     * @return unsigned long bytes, 0 if the lookahead is fully erased or no file is being written 
+     */
+    unsigned long getLookaheadRemaining(); 
+
+    /**
+     * @brief set the FIFO fill level that triggers a flush 
+     * 
+     * Lower watermarks give shorter, more frequent program bursts. Ignored while power saving. 
+     * 
+     * @param bytes watermark, rounded down to whole pages, 0 to flush when the FIFO is full. A smaller FIFO is flushed when full 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if out of range 
+     */
+    FlashStorage_status_t setFlushThreshold(unsigned int bytes); 
+
+    /**
+     * @brief use application memory for the write FIFO 
+     * 
+     * @param buff FIFO memory, NULL to go back to the internal FIFO 
+     * @param size size of buff, a multiple of FLASH_STORAGE_PAGE_SIZE 
+     * @return FlashStorage_status_t FLASH_STORAGE_WRONG_MODE if a file is open 
+     */
+    FlashStorage_status_t setBuffer(byte* buff, unsigned int size); 
+
+    /**
+     * @brief draw the write FIFO from a shared pool 
+     * 
+     * The FIFO is taken from the pool when a file is opened for writing and given back when it is closed, so idle 
+     * instances hold no buffer. If fewer than pages blocks are free in a row, a shorter run down to one page is taken. 
+     * A stream that fills its FIFO borrows free blocks up to max_pages, which it keeps until the file is closed. 
+     * 
+     * @param pool shared pool, NULL to stop using it 
+     * @param pages FIFO size wanted, in pages 
+     * @param max_pages largest FIFO a busy stream may grow to, in pages, 0 for pages 
+     * @return FlashStorage_status_t FLASH_STORAGE_WRONG_MODE if a file is open, FLASH_STORAGE_INVALID_CONFIG if 
+     * max_pages is below pages 
+     */
+    FlashStorage_status_t setBufferPool(FlashStorageBufferPool* pool, unsigned int pages, unsigned int max_pages = 0); 
+
+    /**
+     * @brief let write() adjust the lookahead and the flush watermark to the workload 
+     * 
+     * Tracks the arrival rate and spacing of writes. The lookahead covers the data arriving during one learned erase 
+     * time plus an erase unit, so erases finish before the writer reaches them. The watermark is sized so a flush burst 
+     * (learned program time per page, spread over striped devices) fits in the average gap between writes. Stays 
+     * within the mode's minimum lookahead, FLASH_STORAGE_MAX_LOOKAHEAD_SIZE and the FIFO. The FIFO itself is never 
+     * resized, RAM use stays what setBuffer() or the pool gave. Not applied while power saving, which always fills the 
+     * FIFO. 
+     * 
+     * @param enabled true to enable 
+     */
+    void setAutoTune(bool enabled); 
+
+    /**
+     * @brief get the current lookahead distance 
+     * 
+     * @return unsigned long bytes 
+     */
+    unsigned long getLookahead(); 
+
+    /**
+     * @brief get the current flush watermark 
+     * 
+     * @return unsigned int bytes 
+     */
+    unsigned int getFlushThreshold(); 
+
+    /**
+     * @brief get the write arrival rate seen by the auto tuner 
+     * 
+     * @return unsigned long bytes per second 
+     */
+    unsigned long getArrivalRate(); 
+
+    /**
+     * @brief writes a complete file in one call 
+     * 
+     * Files up to FLASH_STORAGE_INLINE_MAX_SIZE are stored inside the FAT with a single FAT write and no data region access, 
+     * as long as the inline pool has room. Larger files go through newFile(), write() and close(). 
+     * 
+     * @param buff contents of the file 
+     * @param length length of the file 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t writeFile(byte* buff, unsigned int length); 
+
+    /**
+     * @brief opens a file for reading (use openForAppend() to append) 
+     * 
+     * Inline files are served from the cached FAT. 
      * 
      * @return FlashStorage_status_t 
      */
     FlashStorage_status_t openFile(unsigned int file_index);
 
+    /**
+     * @brief reopens a closed file for writing at its end 
+     * 
+     * Only the last file in the data region can grow, inline files can't be appended to. The rest of the file's last erase 
+     * unit must still read as erased, the partially written page is then completed with program-without-erase. Erasing 
+     * ahead continues as for a new file. 
+     * 
+     * @param file_index file to append to (1 indexed) 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t openForAppend(unsigned int file_index); 
+
+    /**
+     * @brief flush buffered data of the file being written and record its current end in the FAT 
+     * 
+     * The FIFO otherwise holds back the last partial page until it is completed, so data written since the last sync() is 
+     * lost on power loss. Each sync() costs a short page program and a FAT write, use it sparingly. 
+     * 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t sync(); 
+
+    /**
+     * @brief save the file being written as fast as possible, e.g. from a brownout interrupt 
+     * 
+     * Programs only the buffered data that fits in already erased pages, followed by an end-of-data marker on the next 
+     * page, with no erases and no FAT write. The file is left marked in-progress and its end is restored from the 
+     * marker at the next init(). Buffered data past the erased area is dropped. The file is closed afterwards. 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_NO_SPACE if data had to be dropped 
+     */
+    FlashStorage_status_t emergencyFlush(); 
+
+    /**
+     * @brief get the worst case time emergencyFlush() would take right now 
+     * 
+     * One worst case page program per page of buffered data and the marker, plus whatever is left of an operation 
+     * already running. 
+     * 
+     * @return unsigned long time in us, 0 if no file is being written 
+     */
+    unsigned long getEmergencyFlushTime(); 
+
     /**
      * @brief close out the current file
      * 
@@ -129,7 +631,8 @@ public:
      * 
      * @param buff buffer of data to write 
      * @param length length of data to write 
-     * @return FlashStorage_status_t 
+     * @return FlashStorage_status_t FLASH_STORAGE_OK once the data is accepted, lookahead erases still pending are 
+     * reported by getLookaheadRemaining() 
      */
     FlashStorage_status_t write(byte* buff, unsigned int length);
 
@@ -153,31 +656,499 @@ public:
 
     FlashStorage_status_t deleteAllFiles(); 
 
+    /**
+     * @brief write a partition table to the chip 
+     * 
+     * Replaces whatever is at the start of the volume (including a FAT written without partitions) and mounts the first 
+     * file partition. initializeFAT() must be called on a newly created file partition. 
+     * 
+     * @param partitions partitions to create, whole erase units after the first one, not overlapping 
+     * @param count number of partitions (up to FLASH_STORAGE_MAX_PARTITIONS) 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG when built without FLASH_STORAGE_PARTITIONS 
+     */
+    FlashStorage_status_t writePartitionTable(FlashStoragePartition* partitions, unsigned int count); 
+
+    /**
+     * @brief get the number of partitions found at init() 
+     * 
+     * @return unsigned int partition count, 0 without a partition table 
+     */
+    unsigned int getPartitionCount(); 
+
+    /**
+     * @brief get a copy of a partition entry 
+     * 
+     * @param index partition index (0 indexed) 
+     * @param partition partition to copy into 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t getPartition(unsigned int index, FlashStoragePartition* partition); 
+
+    /**
+     * @brief switch the file system to another file partition 
+     * 
+     * Closes any open file and reads the FAT of the partition. 
+     * 
+     * @param index partition index (0 indexed) 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG when built without FLASH_STORAGE_PARTITIONS 
+     */
+    FlashStorage_status_t mountPartition(unsigned int index); 
+
+    /**
+     * @brief reserve space at the end of the file area for direct access 
+     * 
+     * The file area shrinks by size (rounded up to whole erase units). The new end is recorded in the FAT and restored by 
+     * init(), so files are never placed in the region, but the region itself must be reserved again with the same size 
+     * after every init(). Used by FlashKVStore when there is no KV partition. 
+     * 
+     * @param size number of bytes to reserve 
+     * @param start_addr set to the first logical address of the reserved region 
+     * @return FlashStorage_status_t FLASH_STORAGE_WRONG_MODE if the partition table has no file partition 
+     */
+    FlashStorage_status_t reserveRegion(unsigned long size, unsigned long* start_addr); 
+
+    /**
+     * @brief get the logical erase unit size 
+     * 
+     * @return unsigned long erase unit size (bytes) 
+     */
+    unsigned long getEraseSize(); 
+
+    /**
+     * @brief get the number of status register reads issued while waiting on the devices 
+     * 
+     * Waits sleep until the learned completion time of the pending operation and only then poll with backoff, this 
+     * counter shows how often the bus was still used for polling. 
+     * 
+     * @return unsigned long status reads since init 
+     */
+    unsigned long getStatusReads(); 
+
+    /**
+     * @brief compare the copies of a mirrored array on every read 
+     * 
+     * Each piece read from one mirror is read again from the other mirrors. A torn page program or a cell losing its 
+     * charge only turns 0 bits into 1, so where the copies disagree the bitwise AND of them is returned. Doubles the bus 
+     * time of a read, a mirror that is busy at the time is not compared. On by default. 
+     * 
+     * @param verify false to read a single copy 
+     */
+    void setMirrorVerify(bool verify); 
+
+    /**
+     * @brief get the number of read pieces whose mirrors disagreed 
+     * 
+     * @return unsigned long pieces since init 
+     */
+    unsigned long getMirrorMismatches(); 
+
+    /**
+     * @brief get the learned operation times of a device 
+     * 
+     * @param device device index 
+     * @param program_us set to the page program time estimate 
+     * @param erase_us set to the sector erase time estimate 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG for an unknown device 
+     */
+    FlashStorage_status_t getOperationTimes(unsigned int device, unsigned long* program_us, unsigned long* erase_us); 
+
+    /**
+     * @brief share the SPI bus with other devices 
+     * 
+     * Reads are split so that no transfer holds the bus longer than max_hold_us at the given SPI clock, and the yield 
+     * callback is called between transfers and while waiting on busy devices. A page program always transfers a whole 
+     * page (up to 260 bytes), keep max_hold_us above that at the bus clock. 
+     * 
+     * @param max_hold_us longest time a single read may hold the bus, 0 to read without splitting 
+     * @param bus_clock_hz SPI clock used for the flash chips 
+     * @param callback yield function, NULL for none 
+     * @param context passed to every call 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if max_hold_us at bus_clock_hz leaves no room for data 
+     * after the read command, the previous settings are kept 
+     */
+    FlashStorage_status_t setBusArbitration(unsigned long max_hold_us, unsigned long bus_clock_hz, FlashStorage_yield_callback_t callback = NULL, void* context = NULL); 
+
+    /**
+     * @brief set the function used to change the SPI clock of a device 
+     * 
+     * Set before init() so the rates saved by calibrateClock() are applied when the FAT is read. 
+     * 
+     * @param callback clock setter, NULL for none 
+     * @param context passed to every call 
+     */
+    void setClockCallback(FlashStorage_clock_callback_t callback, void* context = NULL); 
+
+    /**
+     * @brief find the fastest reliable SPI clock of each device and save it with the FAT 
+     * 
+     * A test pattern is programmed to a scratch page in the FAT unit of every device that has one, then read back 
+     * FLASH_STORAGE_CALIBRATION_READS times at each rate. The rate one step below the fastest that passes (and all slower 
+     * ones passed) is kept as margin. Devices without a scratch page (ping pong and concatenated arrays only place the 
+     * FAT unit on one device) stay at the first rate. Needs a clock callback and no open file. 
+     * 
+     * @param rates clock rates to try (Hz), slowest first, the first one must be known to work 
+     * @param rate_count number of rates 
+     * @return FlashStorage_status_t FLASH_STORAGE_FLASH_FAIL if a device fails at the first rate, 
+     * FLASH_STORAGE_INVALID_CONFIG when built without FLASH_STORAGE_CLOCK_CALIBRATION 
+     */
+    FlashStorage_status_t calibrateClock(unsigned long* rates, unsigned int rate_count); 
+
+    /**
+     * @brief get the calibrated SPI clock of a device 
+     * 
+     * @param device device index 
+     * @return unsigned long clock rate (Hz), 0 if not calibrated 
+     */
+    unsigned long getClockRate(unsigned int device); 
+
+    /**
+     * @brief set the function used to put devices into deep power-down and wake them 
+     * 
+     * Set before init(), init() releases the devices from power-down in case they were left there. 
+     * 
+     * @param callback power control function, NULL for none 
+     * @param context passed to every call 
+     * @param wake_us time a device needs after release before it accepts commands (tRES1) 
+     */
+    void setPowerCallback(FlashStorage_power_callback_t callback, void* context = NULL, unsigned long wake_us = FLASH_STORAGE_WAKE_TIME_US); 
+
+    /**
+     * @brief keep the devices in deep power-down between write bursts 
+     * 
+     * Writes collect in the FIFO (FLASH_STORAGE_FIFO_BUFFER_SIZE or setBuffer()) with no lookahead erase. 
+     * When it fills the devices are woken, erased as needed and programmed in one burst, then powered down again once 
+     * idle. sync() and close() also power down afterwards. Any other access wakes the devices, use powerDown() after 
+     * reading. Needs a power callback. 
+     * 
+     * The burst size is not derived from the wake latency, it is always the whole FIFO: the largest burst spreads each 
+     * wakeup over the most data and write() flushes before the FIFO can overflow. Use the wake latency from 
+     * getPowerStats() to choose the FIFO size for a power budget. 
+     * 
+     * @param enabled true to enable 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG when enabled in a build without FLASH_STORAGE_POWER_SAVING 
+     */
+    FlashStorage_status_t setPowerSaving(bool enabled); 
+
+    /**
+     * @brief wait for the devices to finish and put them into deep power-down 
+     * 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t powerDown(); 
+
+    /**
+     * @brief get the power statistics since init 
+     * 
+     * @param wake_count number of wakeups 
+     * @param wake_latency_us longest wakeup, callback plus tRES1 
+     * @param awake_us total time the devices spent awake after a wakeup 
+     */
+    void getPowerStats(unsigned long* wake_count, unsigned long* wake_latency_us, unsigned long* awake_us); 
+
+    /**
+     * @brief get the time the last mount spent reading the FAT 
+     * 
+     * Includes checking both FAT copies and recovering a file that was not closed. 
+     * 
+     * @return unsigned long time in us 
+     */
+    unsigned long getRecoveryTime(); 
+
+    /**
+     * @brief replace the Arduino time functions 
+     * 
+     * Every timestamp and wait in the library goes through these, e.g. to run against a virtual clock and a simulated 
+     * W25Q64 driver so timing results are reproducible. Set before init(). 
+     * 
+     * @param time_callback current time (us), NULL for micros() 
+     * @param delay_callback wait a number of us, NULL for delay() and delayMicroseconds() 
+     * @param context passed to every call 
+     */
+    void setTimeCallbacks(FlashStorage_time_callback_t time_callback, FlashStorage_delay_callback_t delay_callback, void* context = NULL); 
+
+    /**
+     * @brief log API calls to a RAM ring 
+     * 
+     * Does nothing when built without FLASH_STORAGE_TRACE. 
+     * 
+     * @param buff ring buffer, NULL to stop tracing 
+     * @param size size of buff, holds size / FLASH_STORAGE_TRACE_RECORD_SIZE records 
+     */
+    void setTrace(byte* buff, unsigned int size); 
+
+    /**
+     * @brief get the number of records in the trace ring 
+     * 
+     * @return unsigned int record count 
+     */
+    unsigned int getTraceCount(); 
+
+    /**
+     * @brief decode a trace record 
+     * 
+     * @param index record index, 0 is the oldest 
+     * @param record decoded record 
+     * @return FlashStorage_status_t FLASH_STORAGE_NOT_FOUND past the last record 
+     */
+    FlashStorage_status_t getTraceRecord(unsigned int index, FlashStorageTraceRecord* record); 
+
+    /**
+     * @brief collect write() latency and throughput statistics 
+     * 
+     * Does nothing when built without FLASH_STORAGE_WRITE_STATS. 
+     * 
+     * @param enabled true to start (and clear) the statistics, false to stop 
+     */
+    void setWriteStats(bool enabled); 
+
+    /**
+     * @brief get the write statistics since setWriteStats() 
+     * 
+     * @param stats statistics 
+     * @return FlashStorage_status_t FLASH_STORAGE_NOT_FOUND if no write was measured 
+     */
+    FlashStorage_status_t getWriteStats(FlashStorageWriteStats* stats); 
+
+    /**
+     * @brief issue the calls of a recorded trace again with the recorded spacing 
+     * 
+     * Writes send the contents of data, in pieces if a recorded write is longer. Reads go into data. 
+     * 
+     * @param records trace records, oldest first 
+     * @param count number of records 
+     * @param data buffer used for the writes and reads 
+     * @param data_size size of data 
+     * @return FlashStorage_status_t the last failure, FLASH_STORAGE_OK if all calls succeeded, FLASH_STORAGE_INVALID_CONFIG 
+     * without a data buffer 
+     */
+    FlashStorage_status_t replayTrace(FlashStorageTraceRecord* records, unsigned int count, byte* data, unsigned int data_size); 
+
+    /**
+     * @brief route page programs through an application supplied function 
+     * 
+     * The W25Q64 driver and the Arduino SPI library only drive one data lane. On a board with a quad capable SPI 
+     * peripheral the application can send the data phase over four lanes. Every page program (file data, FAT, partition 
+     * table, KV records) goes through it. The library issues no quad commands and does not probe for quad support (JEDEC 
+     * ID, QE bit), the callback has to set the device up itself. A device whose callback returns an error keeps using the 
+     * standard page program from then on. 
+     * 
+     * @param callback page program function, NULL to go back to the standard page program 
+     * @param context passed to every call 
+     */
+    void setProgramCallback(FlashStorage_program_callback_t callback, void* context = NULL); 
+
+    /**
+     * @brief read logical addresses directly, waits for pending operations first 
+     * 
+     * @param addr logical address to start at 
+     * @param buff buffer to read into 
+     * @param length length of data to read 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t readRaw(unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief program already erased logical addresses directly 
+     * 
+     * @param addr logical address to start at 
+     * @param buff data to program 
+     * @param length length of the data 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t programRaw(unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief erase the logical erase unit containing addr 
+     * 
+     * @param addr logical address within the erase unit 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t eraseRaw(unsigned long addr); 
+
+    /**
+     * @brief CRC-16/CCITT 
+     * 
+     * @param buff data to checksum 
+     * @param length length of the data 
+     * @param crc running value, start with 0xFFFF 
+     * @return unsigned int updated crc 
+     */
+    unsigned int crc16(byte* buff, unsigned int length, unsigned int crc = 0xFFFF); 
+
 private: 
-    byte _buff[FLASH_STORAGE_FIFO_BUFFER_SIZE]; 
+    const unsigned char* _config; // configuration symbol seen by the constructing file 
+#if FLASH_STORAGE_FIFO_BUFFER_SIZE > 0 
+    byte _fifo[FLASH_STORAGE_FIFO_BUFFER_SIZE]; 
+    byte* _buff = _fifo; 
+#else 
+    byte* _buff = NULL; 
+#endif 
+    unsigned int _buff_size = FLASH_STORAGE_FIFO_BUFFER_SIZE; 
     unsigned int _buff_index = 0;
+    FlashStorageBufferPool* _pool = NULL; 
+    unsigned int _pool_pages = 0; // FIFO pages wanted from the pool 
+    unsigned int _pool_max_pages = 0; // FIFO pages a full stream may borrow up to 
 
     unsigned int _opened_file = 0; // 1 indexed! 
     unsigned long _curr_addr; // address to write to 
     unsigned long _max_erased_addr; // exclusive, should always be a multiple of 4096 (sector erase size) 
     unsigned long _lookahead_erase_size = FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE; // the size ahead to trigger an erase 
+    unsigned long _min_lookahead = FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE; // smallest lookahead the array mode works with 
+    unsigned int _flush_threshold = 0; // FIFO fill level that triggers a flush, 0 when full 
+    bool _auto_tune = false; 
+    unsigned long _arrival_rate = 0; // bytes per second 
+    unsigned long _write_gap = 0; // average time between writes (us) 
+    unsigned long _last_write = 0; // time of the last write, 0 before the first 
+    unsigned long _reserve_addr = 0; // exclusive, target of a reserve(), multiple of the erase unit 
+
+    W25Q64 _flash[FLASH_STORAGE_MAX_DEVICES]; 
+    unsigned int _device_count = 1; 
+    unsigned long _device_size[FLASH_STORAGE_MAX_DEVICES]; // bytes used on each device, recorded in the FAT 
+    FlashStorageArrayMode _array_mode = FLASH_STORAGE_ARRAY_SINGLE; 
+    unsigned long _stripe_size = FLASH_STORAGE_PAGE_SIZE; // contiguous run of logical addresses on one device 
+    unsigned long _erase_size = FLASH_STORAGE_SECTOR_SIZE; // logical erase unit 
+    unsigned long _capacity = FLASH_STORAGE_DEVICE_SIZE; // size of the logical address space 
+    unsigned int _read_device = 0; // mirror to start the next read on 
+    bool _read_pinned = false; // keep reading the same mirror, while checking the FAT copies 
+    bool _mirror_verify = true; // compare the mirrors on every read 
+    unsigned long _mirror_mismatches = 0; 
+
+    FlashStorageOperation _op_type[FLASH_STORAGE_MAX_DEVICES]; // last operation started on each device 
+    unsigned long _op_start[FLASH_STORAGE_MAX_DEVICES]; // micros() when it was started 
+    unsigned long _program_time[FLASH_STORAGE_MAX_DEVICES]; // learned page program time (us) 
+    unsigned long _erase_time[FLASH_STORAGE_MAX_DEVICES]; // learned sector erase time (us) 
+    unsigned long _status_reads = 0; 
+
+    unsigned long _bus_chunk = 0; // largest read per transfer, 0 for no limit 
+    FlashStorage_yield_callback_t _yield_callback = NULL; 
+    void* _yield_context = NULL; 
+
+#if FLASH_STORAGE_CLOCK_CALIBRATION 
+    FlashStorage_clock_callback_t _clock_callback = NULL; 
+    void* _clock_context = NULL; 
+    unsigned long _clock_rate[FLASH_STORAGE_MAX_DEVICES]; // calibrated clock, 0 if not calibrated 
+    bool _clock_calibrated = false; // write the calibration record with the FAT 
+#else 
+    static const bool _clock_calibrated = false; 
+#endif 
+
+#if FLASH_STORAGE_POWER_SAVING 
+    FlashStorage_power_callback_t _power_callback = NULL; 
+    void* _power_context = NULL; 
+    unsigned long _wake_time = FLASH_STORAGE_WAKE_TIME_US; 
+    bool _power_saving = false; 
+    bool _asleep = false; 
+    unsigned long _wake_count = 0; 
+    unsigned long _wake_latency = 0; 
+    unsigned long _awake_start = 0; 
+    unsigned long _awake_time = 0; 
+#else 
+    // checked on the write path, the compiler drops the power-down branches 
+    static const bool _power_saving = false; 
+    static const bool _asleep = false; 
+#endif 
+
+    FlashStorage_time_callback_t _time_callback = NULL; 
+    FlashStorage_delay_callback_t _delay_callback = NULL; 
+    void* _time_context = NULL; 
+
+#if FLASH_STORAGE_TRACE 
+    byte* _trace_buff = NULL; 
+    unsigned int _trace_capacity = 0; // records 
+    unsigned int _trace_head = 0; // next record to write 
+    unsigned int _trace_count = 0; 
+#else 
+    static const unsigned int _trace_capacity = 0; 
+#endif 
+#if FLASH_STORAGE_TRACE || FLASH_STORAGE_WRITE_STATS 
+    unsigned int _trace_depth = 0; // nesting of traced calls 
+#endif 
+
+#if FLASH_STORAGE_WRITE_STATS 
+    bool _write_stats = false; 
+    unsigned long _stats_start = 0; 
+    unsigned long _stats_bytes = 0; 
+    unsigned long _stats_max = 0; 
+    unsigned long _latency_histogram[FLASH_STORAGE_LATENCY_BUCKETS]; // bucket b counts latencies below 2^(b+1) us 
+#else 
+    static const bool _write_stats = false; 
+#endif 
+
+    /**
+     * @brief logs one traced API call when it goes out of scope, nested calls are left out 
+     * 
+     * Also feeds the write statistics. 
+     */
+    class TraceScope{
+    public: 
+        TraceScope(FlashStorage* storage, FlashStorageTraceOp op, unsigned long arg); 
+        ~TraceScope(); 
+    private: 
+        FlashStorage* _storage; 
+        FlashStorageTraceOp _op; 
+        unsigned long _arg; 
+        unsigned long _start; 
+    }; 
+
+    FlashStorage_program_callback_t _program_callback = NULL; 
+    void* _program_context = NULL; 
+    bool _program_fallback[FLASH_STORAGE_MAX_DEVICES]; // device rejected the program callback 
+
+#if FLASH_STORAGE_PARTITIONS 
+    FlashStoragePartition _partitions[FLASH_STORAGE_MAX_PARTITIONS]; 
+    unsigned int _partition_count = 0; 
+#endif 
+    unsigned long _fat_addr = 0; // start of the file area, holds the FAT 
+    bool _files_mounted = true; // false with a partition table that has no file partition 
+    unsigned int _fat_units = FLASH_STORAGE_FAT_UNITS; // erase units reserved for the FAT, files follow them 
+    unsigned int _fat_active = 0; // unit holding the current table 
+    unsigned long _fat_sequence = 0; // sequence of the current table 
+    unsigned long _recovery_time = 0; 
+    unsigned long _area_end = FLASH_STORAGE_DEVICE_SIZE; // end of the file area (exclusive) 
+    unsigned long _area_limit = FLASH_STORAGE_DEVICE_SIZE; // end of the file area before any reserveRegion() 
+    unsigned long _area_reserved = 0; // bytes taken by reserveRegion() since init() 
 
-    W25Q64 _flash; 
     W25Q64_status_t _flash_status; 
     FlashStorageFAT _fat; 
     FlashStorage_status_t _status; 
-    FlashStorageMode _mode; 
+    FlashStorageMode _mode = FLASH_STORAGE_NO_MODE; 
 
     /**
      * @brief writes the FIFO buffer contents 
      * 
-     * Writes all data in the FIFO buffer. Intended to be used when closing out a file, or when the buffer is completely full. 
-     * 
-     * Does some extra things to make sure all writes are in 256 byte chunks. 
+     * Normally only programs up to the last page boundary so every program is a complete, aligned page. The sub page tail 
+     * is moved to the front of the FIFO and kept for the next write. 
      * 
+     * @param flush_all also program the partial page at the end, used by sync() and close() 
      * @return FlashStorage_status_t 
      */
-    FlashStorage_status_t writeFIFO(); 
+    FlashStorage_status_t writeFIFO(bool flush_all = false); 
+
+    /**
+     * @brief take the FIFO from the buffer pool, if one is set 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_NO_SPACE if the pool is exhausted or there is no FIFO at all 
+     */
+    FlashStorage_status_t acquireBuffer(); 
+
+    /**
+     * @brief give the FIFO back to the buffer pool, if one is set 
+     */
+    void releaseBuffer(); 
+
+    /**
+     * @brief move the FIFO to a longer pool run, up to the borrowing limit 
+     * 
+     * Keeps the data in the FIFO. Stays on the current run if no longer one is free. 
+     */
+    void growBuffer(); 
+
+    /**
+     * @brief update the arrival statistics and retune the lookahead and the flush watermark 
+     * 
+     * @param length length of the write being made 
+     */
+    void autoTune(unsigned int length); 
 
     /**
      * @brief reads and parses the FAT table (if any) 
@@ -188,6 +1159,23 @@ private:
      */
     FlashStorage_status_t readFAT(); 
 
+    /**
+     * @brief check and optionally load one FAT copy 
+     * 
+     * @param addr address of the FAT unit 
+     * @param apply load the table into _fat if it is valid 
+     * @param header set to the header fields of a valid table (sequence 0 and 1 unit for version 1) 
+     * @return FlashStorage_status_t FLASH_STORAGE_INVALID_CONFIG if written by a different array layout 
+     */
+    FlashStorage_status_t parseFAT(unsigned long addr, bool apply, FlashStorageFATHeader* header); 
+
+    /**
+     * @brief reads and parses the partition table (if any) 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_NOT_FOUND if there is no valid table 
+     */
+    FlashStorage_status_t readPartitionTable(); 
+
     /**
      * @brief write the FAT table to the chip 
      * 
@@ -195,11 +1183,242 @@ private:
      * 
      * @return FlashStorage_status_t 
      */
-    FlashStorage_status_t writeFAT(); 
+    FlashStorage_status_t writeFAT();
 
+    /**
+     * @brief add bytes to a FAT being encoded, programming each chunk as it fills 
+     * 
+     * @param stream FAT being encoded 
+     * @param data bytes to add 
+     * @param length number of bytes 
+     * @return FlashStorage_status_t the first failed chunk program, nothing more is programmed after it 
+     */
+    FlashStorage_status_t streamFAT(FlashStorageFATStream* stream, byte* data, unsigned int length); 
+
+    /**
+     * @brief program what is left of a FAT being encoded 
+     * 
+     * @param stream FAT being encoded 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t flushFAT(FlashStorageFATStream* stream);  
+
+
+    /**
+     * @brief restore the end of a file that was not closed 
+     * 
+     * Scans from the recorded end for an end-of-data marker or the first blank page, then writes the FAT. 
+     * 
+     * @param file_index file marked in-progress (1 indexed) 
+     * @param scan_end end of the file area recorded with the FAT, 0 if unknown 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t recoverFile(unsigned int file_index, unsigned long scan_end); 
+
+    /**
+     * @brief read the calibration record of the FAT unit and apply its clock rates 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_NOT_FOUND if there is no valid record 
+     */
+    FlashStorage_status_t readCalibration(); 
+
+    /**
+     * @brief program the calibration record to the last page of the (erased) FAT unit 
+     * 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t writeCalibration(); 
 
     FlashStorage_status_t eraseNextSector(); 
 
+    /**
+     * @brief check if the write position is within the lookahead of the erase frontier 
+     * 
+     * Counts the buffered data and the blank page writeFIFO() keeps after it, so the lookahead runs ahead of what a 
+     * flush will need. 
+     * 
+     * @return true if eraseNextSector() should be triggered 
+     */
+    bool lookaheadNeeded(); 
+
+    /**
+     * @brief erase units until the lookahead is covered 
+     * 
+     * @return FlashStorage_status_t FLASH_STORAGE_BUSY if the next unit is still on busy devices 
+     */
+    FlashStorage_status_t eraseAhead(); 
+
+    /**
+     * @brief erase units, waiting on the devices, until everything below end is erased 
+     * 
+     * @param end first address that does not need to be erased, capped at the end of the file area 
+     * @return FlashStorage_status_t FLASH_STORAGE_NO_SPACE if the file area ends before end 
+     */
+    FlashStorage_status_t eraseThrough(unsigned long end); 
+
+    /**
+     * @brief check that a range of logical addresses reads back as erased (0xFF) 
+     * 
+     * @param addr logical address to start at 
+     * @param length length of the range 
+     * @return true if every byte is erased 
+     */
+    bool isErased(unsigned long addr, unsigned long length); 
+
+    /**
+     * @brief get the number of bytes used in the inline pool 
+     * 
+     * @return unsigned int end of the last inline file 
+     */
+    unsigned int inlineUsed(); 
+
+    /**
+     * @brief translate a logical address to a device and device address 
+     * 
+     * @param addr logical address 
+     * @param device device index the address lives on 
+     * @param local address on that device 
+     */
+    void mapAddress(unsigned long addr, unsigned int* device, unsigned long* local); 
+
+    /**
+     * @brief check if any device in the array is busy 
+     * 
+     * @return true if at least one device is busy 
+     */
+    bool busy(); 
+
+    /**
+     * @brief wait for a device to finish its operation 
+     * 
+     * Sleeps until the learned completion time of the last operation started on the device, then polls the status 
+     * register with a doubling delay. The measured time updates the estimate (1/8 weight). 
+     * 
+     * @param device device to wait on 
+     */
+    void waitForDevice(unsigned int device); 
+
+    /**
+     * @brief wait for every device in the array to finish 
+     */
+    void waitForDevices(); 
+
+    /**
+     * @brief record the start of a program or erase for waitForDevice() 
+     * 
+     * @param device device the operation was started on 
+     * @param op operation type 
+     */
+    void startOperation(unsigned int device, FlashStorageOperation op); 
+
+    /**
+     * @brief release the devices from deep power-down if they are in it 
+     */
+    void wakeDevices(); 
+
+    /**
+     * @brief hand the bus to the application between transfers, if a yield callback is set 
+     */
+    void yieldBus(); 
+
+    /**
+     * @brief get the current time from the time callback or micros() 
+     * 
+     * @return unsigned long time in us 
+     */
+    unsigned long timeMicros(); 
+
+    /**
+     * @brief delay for a number of microseconds, longer delays are split into delay() and delayMicroseconds() 
+     * 
+     * @param us time to wait 
+     */
+    void sleepMicros(unsigned long us); 
+
+    /**
+     * @brief check if any device backing an erase unit is busy 
+     * 
+     * @param addr logical address within the erase unit 
+     * @return true if the erase unit can't be erased right now 
+     */
+    bool unitBusy(unsigned long addr); 
+
+    /**
+     * @brief check if an erase unit lives entirely on one device 
+     * 
+     * @return true for ping pong and concatenated arrays, false when the unit spans (striped) or is copied to (mirrored) every device 
+     */
+    bool unitOnOneDevice(); 
+
+    /**
+     * @brief erase the logical erase unit containing addr 
+     * 
+     * Starts the erase on every device backing the unit without waiting for completion. Only waits on those devices. 
+     * 
+     * @param addr logical address within the erase unit 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t eraseUnit(unsigned long addr); 
+
+    /**
+     * @brief program data to already erased logical addresses 
+     * 
+     * Splits the data into page programs. Only waits on the device the next page lives on. 
+     * 
+     * @param addr logical address to start at 
+     * @param buff data to program 
+     * @param length length of the data 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t programData(unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief issue a single page program on one device, through the program callback if there is one 
+     * 
+     * The device must not be busy. 
+     * 
+     * @param device device to program 
+     * @param addr device address 
+     * @param buff data to program 
+     * @param length length of the data, must not cross a page 
+     */
+    void programPage(unsigned int device, unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief read data from logical addresses 
+     * 
+     * @param addr logical address to start at 
+     * @param buff buffer to read into 
+     * @param length length of data to read 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t readData(unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief read data from a mirrored array 
+     * 
+     * Serves the read from one mirror and moves on to the next for the following read, falls back to the other copies on 
+     * failure. 
+     * 
+     * @param addr logical address to start at 
+     * @param buff buffer to read into 
+     * @param length length of data to read 
+     * @return FlashStorage_status_t 
+     */
+    FlashStorage_status_t readMirrored(unsigned long addr, byte* buff, unsigned int length); 
+
+    /**
+     * @brief compare a piece read from one mirror with the other mirrors 
+     * 
+     * Bits that differ are cleared in buff. 
+     * 
+     * @param source device the piece was read from 
+     * @param addr logical address of the piece 
+     * @param buff data read from source 
+     * @param length length of the piece 
+     */
+    void verifyMirrors(unsigned int source, unsigned long addr, byte* buff, unsigned int length); 
+
 }; 
 
 
@@ -0,0 +1,116 @@
+/**
+ * @file FlashStorageConfig.hpp
+ * @author Jeremy Dunne
+ * @brief Flash Storage build configuration
+ * @version 0.1
+ * @date 2022-12-23
+ *
+ * Sizes that change the layout of FlashStorage. They are part of the library build, so change them here (or with a -D
+ * build flag applied to every file, library included), never with a #define in the sketch before the include. A sketch
+ * built with different sizes than the library fails to link with an undefined flash_storage_config_... symbol.
+ * Set them as plain numbers, they are pasted into that symbol name. The feature switches below are 0 or 1, a feature
+ * built out keeps its API, its calls return FLASH_STORAGE_INVALID_CONFIG or report nothing.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _FLASH_STORAGE_CONFIG_HPP_
+#define _FLASH_STORAGE_CONFIG_HPP_
+
+// uncomment for the smallest microcontrollers, any size below can also be set on its own
+// #define FLASH_STORAGE_MINIMAL_RAM
+
+#ifdef FLASH_STORAGE_MINIMAL_RAM
+#ifndef FLASH_STORAGE_FIFO_BUFFER_SIZE
+#define FLASH_STORAGE_FIFO_BUFFER_SIZE 256
+#endif
+#ifndef FLASH_STORAGE_MAX_FILE_NUMBER
+#define FLASH_STORAGE_MAX_FILE_NUMBER 8
+#endif
+#ifndef FLASH_STORAGE_MAX_DEVICES
+#define FLASH_STORAGE_MAX_DEVICES 1
+#endif
+#ifndef FLASH_STORAGE_INLINE_MAX_SIZE
+#define FLASH_STORAGE_INLINE_MAX_SIZE 32
+#endif
+#ifndef FLASH_STORAGE_INLINE_POOL_SIZE
+#define FLASH_STORAGE_INLINE_POOL_SIZE 32
+#endif
+#ifndef FLASH_STORAGE_FAT_CHUNK_SIZE
+#define FLASH_STORAGE_FAT_CHUNK_SIZE 32
+#endif
+#ifndef FLASH_STORAGE_LATENCY_BUCKETS
+#define FLASH_STORAGE_LATENCY_BUCKETS 16
+#endif
+#ifndef FLASH_STORAGE_TRACE
+#define FLASH_STORAGE_TRACE 0
+#endif
+#ifndef FLASH_STORAGE_POWER_SAVING
+#define FLASH_STORAGE_POWER_SAVING 0
+#endif
+#ifndef FLASH_STORAGE_WRITE_STATS
+#define FLASH_STORAGE_WRITE_STATS 0
+#endif
+#ifndef FLASH_STORAGE_PARTITIONS
+#define FLASH_STORAGE_PARTITIONS 0
+#endif
+#ifndef FLASH_STORAGE_CLOCK_CALIBRATION
+#define FLASH_STORAGE_CLOCK_CALIBRATION 0
+#endif
+#endif
+
+#ifndef FLASH_STORAGE_FIFO_BUFFER_SIZE
+#define FLASH_STORAGE_FIFO_BUFFER_SIZE 1024 // must be a multiple of FLASH_STORAGE_PAGE_SIZE, raise it for longer power down periods, 0 for none
+#endif
+#ifndef FLASH_STORAGE_MAX_FILE_NUMBER
+#define FLASH_STORAGE_MAX_FILE_NUMBER 32 // volumes with more files can't be mounted
+#endif
+#ifndef FLASH_STORAGE_MAX_DEVICES
+#define FLASH_STORAGE_MAX_DEVICES 4
+#endif
+#ifndef FLASH_STORAGE_INLINE_MAX_SIZE
+#define FLASH_STORAGE_INLINE_MAX_SIZE 64 // files up to this size are kept inside the FAT
+#endif
+#ifndef FLASH_STORAGE_INLINE_POOL_SIZE
+#define FLASH_STORAGE_INLINE_POOL_SIZE 256 // total inline data the FAT can hold, volumes with more can't be mounted
+#endif
+#ifndef FLASH_STORAGE_FAT_CHUNK_SIZE
+#define FLASH_STORAGE_FAT_CHUNK_SIZE 256 // the FAT is encoded and decoded in pieces of this size, must divide a page
+#endif
+#ifndef FLASH_STORAGE_LATENCY_BUCKETS
+#define FLASH_STORAGE_LATENCY_BUCKETS 24 // power of 2 latency buckets, the last one holds everything above
+#endif
+#ifndef FLASH_STORAGE_TRACE
+#define FLASH_STORAGE_TRACE 1 // setTrace() call ring
+#endif
+#ifndef FLASH_STORAGE_POWER_SAVING
+#define FLASH_STORAGE_POWER_SAVING 1 // setPowerCallback() and deep power-down between writes
+#endif
+#ifndef FLASH_STORAGE_WRITE_STATS
+#define FLASH_STORAGE_WRITE_STATS 1 // setWriteStats() latency histogram
+#endif
+#ifndef FLASH_STORAGE_PARTITIONS
+#define FLASH_STORAGE_PARTITIONS 1 // partition tables, volumes with one can't be mounted without
+#endif
+#ifndef FLASH_STORAGE_CLOCK_CALIBRATION
+#define FLASH_STORAGE_CLOCK_CALIBRATION 1 // calibrateClock() and the rates saved with the FAT
+#endif
+
+// one symbol per configuration, defined by the library build and referenced by every FlashStorage constructor
+#define FLASH_STORAGE_CONFIG_PASTE(fifo, files, devices, inline_max, inline_pool, chunk, buckets, trace, power, stats, \
+    partitions, clock) \
+    flash_storage_config_##fifo##_##files##_##devices##_##inline_max##_##inline_pool##_##chunk##_##buckets##_## \
+    trace##power##stats##partitions##clock
+#define FLASH_STORAGE_CONFIG_NAME(fifo, files, devices, inline_max, inline_pool, chunk, buckets, trace, power, stats, \
+    partitions, clock) \
+    FLASH_STORAGE_CONFIG_PASTE(fifo, files, devices, inline_max, inline_pool, chunk, buckets, trace, power, stats, \
+    partitions, clock)
+#define FLASH_STORAGE_CONFIG_SIGNATURE FLASH_STORAGE_CONFIG_NAME(FLASH_STORAGE_FIFO_BUFFER_SIZE, \
+    FLASH_STORAGE_MAX_FILE_NUMBER, FLASH_STORAGE_MAX_DEVICES, FLASH_STORAGE_INLINE_MAX_SIZE, \
+    FLASH_STORAGE_INLINE_POOL_SIZE, FLASH_STORAGE_FAT_CHUNK_SIZE, FLASH_STORAGE_LATENCY_BUCKETS, FLASH_STORAGE_TRACE, \
+    FLASH_STORAGE_POWER_SAVING, FLASH_STORAGE_WRITE_STATS, FLASH_STORAGE_PARTITIONS, FLASH_STORAGE_CLOCK_CALIBRATION)
+
+extern const unsigned char FLASH_STORAGE_CONFIG_SIGNATURE;
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file Arduino.h
+ * @brief minimal Arduino core for running the library on a desktop against the simulated flash
+ * 
+ * Time only moves when the library (or the simulated chip) spends it, see sim_time_us. 
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint8_t byte;
+
+extern unsigned long sim_time_us; // virtual clock
+
+inline unsigned long millis(){ return sim_time_us / 1000; }
+inline unsigned long micros(){ return sim_time_us; }
+inline void delay(unsigned long ms){ sim_time_us += ms * 1000; }
+inline void delayMicroseconds(unsigned int us){ sim_time_us += us; }
+inline void yield(){ sim_time_us += 1; }
+
+struct SimSerial{
+    template<class T> void print(T){}
+    template<class T> void println(T){}
+    void println(){}
+};
+extern SimSerial Serial;
@@ -0,0 +1,112 @@
+/**
+ * @file W25Q64.hpp
+ * @brief simulated W25Q64 driver, copied to lib/W25Q64 of the build directory in place of the real one
+ * 
+ * Each chip select gets 8 MB of memory that starts out as neither erased nor programmed (0xAB). Programs can only clear
+ * bits, a program or erase while busy or without a write enable aborts. Erases keep the chip busy for 45 ms and page
+ * programs for 0.7 ms of virtual time. 
+ * 
+ * Power cuts: when sim_cut_after counts down to 0 on an erase or program, the operation is left half done and the
+ * harness is resumed at sim_cut_jmp. 
+ */
+#pragma once
+#include <Arduino.h>
+#include <setjmp.h>
+
+typedef enum{
+    W25Q64_OK = 0, 
+    W25Q64_BUSY, 
+    W25Q64_FAIL
+} W25Q64_status_t;
+
+#define SIM_DEVICE_SIZE (8ul << 20)
+#define SIM_MAX_DEVICES 32
+#define SIM_ERASE_US 45000
+#define SIM_PROGRAM_US 700
+#define SIM_STATUS_READ_US 2 // one status register read on the bus
+
+extern byte* sim_mem[SIM_MAX_DEVICES]; 
+extern unsigned long sim_busy_until[SIM_MAX_DEVICES]; 
+extern unsigned long sim_status_reads; // busy() polls, all devices 
+extern unsigned long sim_program_count; // page programs, all devices 
+extern unsigned long sim_erase_count; // sector erases, all devices 
+extern long sim_cut_after; // operations left before the power cut, 0 for none 
+extern jmp_buf sim_cut_jmp; 
+
+void simFail(const char* what, int cs, unsigned long addr); 
+
+class W25Q64{
+public:
+    W25Q64_status_t init(int cs_pin){
+        _cs = cs_pin; 
+        if(!sim_mem[_cs]){
+            sim_mem[_cs] = (byte*)malloc(SIM_DEVICE_SIZE); 
+            memset(sim_mem[_cs], 0xAB, SIM_DEVICE_SIZE); 
+        }
+        return W25Q64_OK; 
+    }
+
+    bool busy(){
+        sim_status_reads ++; 
+        sim_time_us += SIM_STATUS_READ_US; 
+        return sim_time_us < sim_busy_until[_cs]; 
+    }
+
+    void writeEnable(){ _write_enabled = true; }
+
+    W25Q64_status_t sectorErase(unsigned long addr){
+        if(busy() || !_write_enabled) simFail("erase while busy or not enabled", _cs, addr); 
+        if(addr >= SIM_DEVICE_SIZE) simFail("erase out of range", _cs, addr); 
+        _write_enabled = false; 
+        sim_erase_count ++; 
+        addr &= ~0xFFFul; 
+        if(cut()){
+            // half the sector is erased 
+            memset(sim_mem[_cs] + addr, 0xFF, 2048); 
+            longjmp(sim_cut_jmp, 1); 
+        }
+        memset(sim_mem[_cs] + addr, 0xFF, 4096); 
+        sim_busy_until[_cs] = sim_time_us + SIM_ERASE_US; 
+        return W25Q64_OK; 
+    }
+
+    W25Q64_status_t pageProgram(unsigned long addr, byte* buff, unsigned int length){
+        if(busy() || !_write_enabled) simFail("program while busy or not enabled", _cs, addr); 
+        _write_enabled = false; 
+        sim_program_count ++; 
+        if(length == 0) return W25Q64_OK; 
+        if((addr & 0xFF) + length > 256) simFail("program crosses a page", _cs, addr); 
+        if(addr + length > SIM_DEVICE_SIZE) simFail("program out of range", _cs, addr); 
+        if(cut()){
+            // the first half of the data made it 
+            for(unsigned int i = 0; i < length / 2; i ++) sim_mem[_cs][addr + i] &= buff[i]; 
+            longjmp(sim_cut_jmp, 1); 
+        }
+        for(unsigned int i = 0; i < length; i ++){
+            byte& cell = sim_mem[_cs][addr + i]; 
+            if((cell & buff[i]) != buff[i]) simFail("program on unerased memory", _cs, addr + i); 
+            cell &= buff[i]; 
+        }
+        sim_busy_until[_cs] = sim_time_us + SIM_PROGRAM_US; 
+        return W25Q64_OK; 
+    }
+
+    W25Q64_status_t readData(unsigned long addr, byte* buff, unsigned int length){
+        if(busy()) return W25Q64_BUSY; 
+        if(addr + length > SIM_DEVICE_SIZE) simFail("read out of range", _cs, addr); 
+        memcpy(buff, sim_mem[_cs] + addr, length); 
+        return W25Q64_OK; 
+    }
+
+    W25Q64_status_t fastRead(unsigned long addr, byte* buff, unsigned int length){
+        return readData(addr, buff, length); 
+    }
+
+private:
+    bool cut(){
+        return sim_cut_after > 0 && -- sim_cut_after == 0; 
+    }
+
+    int _cs = 0; 
+    bool _write_enabled = false; 
+};
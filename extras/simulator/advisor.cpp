@@ -0,0 +1,125 @@
+/**
+ * @file advisor.cpp
+ * @brief replays a trace under every FIFO size, lookahead and flush threshold and prints the Pareto set
+ *
+ * Each setting is replayed on a freshly formatted simulated array, with the FIFO in application memory (setBuffer())
+ * so its size can change without rebuilding. A setting is scored on
+ *     RAM: sizeof(FlashStorage) of a build with FLASH_STORAGE_FIFO_BUFFER_SIZE set to the FIFO size
+ *     p99: 99th percentile write() latency
+ *     throughput: bytes written per second spent inside the library calls of the trace
+ * and printed unless another setting is at least as good on all three and better on one. The trace is read from a file
+ * in the format of tools.hpp, without one (or with -) the sample logging workload of tools.hpp is recorded first.
+ *
+ * usage: advisor [trace file or -] [array mode 0-4]
+ */
+#include "tools.hpp"
+
+#define FIFO_SIZES 6
+#define LOOKAHEADS 4
+#define THRESHOLDS 3
+#define SETTINGS (FIFO_SIZES * LOOKAHEADS * THRESHOLDS)
+
+struct Setting{
+    unsigned int fifo;
+    unsigned long lookahead;
+    unsigned int threshold;
+    unsigned long ram;
+    unsigned long p99_us;
+    unsigned long throughput;
+    FlashStorage_status_t status;
+};
+
+static FlashStorageTraceRecord recorded[TOOLS_MAX_RECORDS];
+static FlashStorageTraceRecord replayed[TOOLS_MAX_RECORDS];
+static byte ring[TOOLS_MAX_RECORDS * FLASH_STORAGE_TRACE_RECORD_SIZE];
+static byte data[4096];
+static byte fifo[8192];
+static unsigned long latencies[TOOLS_MAX_RECORDS];
+static Setting settings[SETTINGS];
+
+/**
+ * @brief replay the trace under one setting and score it
+ */
+static void score(Setting* setting, FlashStorageTraceRecord* records, unsigned int count, int* pins,
+    unsigned int device_count, FlashStorageArrayMode mode){
+    simReset(pins, device_count);
+    FlashStorage fs;
+    fs.init(pins, device_count, mode);
+    fs.initializeFAT();
+    fs.setBuffer(fifo, setting->fifo);
+    setting->status = fs.setLookahead(setting->lookahead);
+    if(setting->status == FLASH_STORAGE_OK) setting->status = fs.setFlushThreshold(setting->threshold);
+    if(setting->status != FLASH_STORAGE_OK) return;
+    fs.setTrace(ring, sizeof(ring));
+    setting->status = fs.replayTrace(records, count, data, sizeof(data));
+    // score from the trace of the replay itself, the write statistics only keep power of 2 buckets
+    unsigned int writes = 0;
+    unsigned long bytes = 0;
+    unsigned long busy_us = 0;
+    for(unsigned int i = 0; i < fs.getTraceCount(); i ++){
+        fs.getTraceRecord(i, &replayed[i]);
+        busy_us += replayed[i].duration_us;
+        if(replayed[i].op != FLASH_STORAGE_TRACE_WRITE) continue;
+        latencies[writes ++] = replayed[i].duration_us;
+        bytes += replayed[i].arg;
+    }
+    setting->p99_us = percentile(latencies, writes, 99);
+    setting->throughput = busy_us ? (unsigned long)((double)bytes * 1000000 / busy_us) : 0;
+    setting->ram = sizeof(FlashStorage) - FLASH_STORAGE_FIFO_BUFFER_SIZE + setting->fifo;
+}
+
+/**
+ * @brief check if a is at least as good as b everywhere and better somewhere
+ */
+static bool dominates(Setting* a, Setting* b){
+    if(a->ram > b->ram || a->p99_us > b->p99_us || a->throughput < b->throughput) return false;
+    return a->ram < b->ram || a->p99_us < b->p99_us || a->throughput > b->throughput;
+}
+
+int main(int argc, char** argv){
+    unsigned int count;
+    if(argc > 1 && strcmp(argv[1], "-") != 0){
+        count = readTrace(argv[1], recorded, TOOLS_MAX_RECORDS);
+        if(count == 0){
+            printf("no records in %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else count = recordSample(recorded, TOOLS_MAX_RECORDS);
+    FlashStorageArrayMode mode = (argc > 2) ? (FlashStorageArrayMode)atoi(argv[2]) : FLASH_STORAGE_ARRAY_SINGLE;
+    unsigned int device_count = (mode == FLASH_STORAGE_ARRAY_SINGLE) ? 1 : 2;
+    int pins[2] = {1, 2};
+    const unsigned int fifo_sizes[FIFO_SIZES] = {256, 512, 1024, 2048, 4096, 8192};
+    const unsigned long lookaheads[LOOKAHEADS] = {FLASH_STORAGE_STANDARD_LOOKAHEAD_SIZE, 0x4000, 0x10000, FLASH_STORAGE_MAX_LOOKAHEAD_SIZE};
+    unsigned int n = 0;
+    for(unsigned int f = 0; f < FIFO_SIZES; f ++){
+        for(unsigned int l = 0; l < LOOKAHEADS; l ++){
+            for(unsigned int t = 0; t < THRESHOLDS; t ++){
+                // flush when full, after a page, or at half the FIFO
+                unsigned int threshold = (t == 0) ? 0 : (t == 1) ? FLASH_STORAGE_PAGE_SIZE : fifo_sizes[f] / 2;
+                // a threshold at or above the FIFO size is the same as flushing when full
+                if(t != 0 && threshold >= fifo_sizes[f]) continue;
+                if(t == 2 && threshold == FLASH_STORAGE_PAGE_SIZE) continue;
+                settings[n].fifo = fifo_sizes[f];
+                settings[n].lookahead = lookaheads[l];
+                settings[n].threshold = threshold;
+                score(&settings[n], recorded, count, pins, device_count, mode);
+                n ++;
+            }
+        }
+    }
+    printf("%u records, %u settings, Pareto set:\n", count, n);
+    printf("%8s %10s %10s %10s %10s %12s\n", "fifo", "lookahead", "threshold", "RAM", "p99 us", "bytes/s");
+    for(unsigned int i = 0; i < n; i ++){
+        // settings the array mode rejects or that fail the trace are out
+        if(settings[i].status != FLASH_STORAGE_OK) continue;
+        bool dominated = false;
+        for(unsigned int j = 0; j < n && !dominated; j ++){
+            dominated = settings[j].status == FLASH_STORAGE_OK && dominates(&settings[j], &settings[i]);
+        }
+        if(dominated) continue;
+        printf("%8u %10lu %10u %10lu %10lu %12lu\n", settings[i].fifo, settings[i].lookahead, settings[i].threshold,
+            settings[i].ram, settings[i].p99_us, settings[i].throughput);
+    }
+    return 0;
+}
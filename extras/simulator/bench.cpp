@@ -0,0 +1,82 @@
+/**
+ * @file bench.cpp
+ * @brief write benchmark, time, call latencies and busy polling of files written back to back in every array mode
+ *
+ * Each mode writes FILE_COUNT files in WRITE_SIZE writes and reads them back in the same pieces. Reports the virtual
+ * time to write and close the files, the p50/p99/max latency of write(), close(), newFile() and read() (taken from a
+ * trace of the run), the status register reads issued while waiting (getStatusReads()) and the operation times the
+ * library learned. The simulated chip takes SIM_PROGRAM_US per page and SIM_ERASE_US per sector.
+ *
+ * Next to the status reads it prints the naive polls, the reads a while(busy()) loop would issue over the same
+ * programs and erases: their busy time divided by the time of one status read (SIM_STATUS_READ_US). The status reads on
+ * the bus also count the busy checks made outside of waits, e.g. before starting a lookahead erase.
+ */
+#include "tools.hpp"
+
+#define FILE_SIZE 0x10000
+#define FILE_COUNT 8
+#define WRITE_SIZE 256
+#define MAX_CALLS (FILE_COUNT * (2 * FILE_SIZE / WRITE_SIZE + 8)) // trace records, every call of the run
+
+static byte data[WRITE_SIZE];
+static byte ring[MAX_CALLS * FLASH_STORAGE_TRACE_RECORD_SIZE];
+static unsigned long latencies[MAX_CALLS];
+
+/**
+ * @brief print p50/p99/max of the traced calls of one type
+ */
+static void printLatency(FlashStorage* fs, const char* name, FlashStorageTraceOp op){
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < fs->getTraceCount(); i ++){
+        FlashStorageTraceRecord record;
+        fs->getTraceRecord(i, &record);
+        if(record.op == op) latencies[n ++] = record.duration_us;
+    }
+    unsigned long p50 = percentile(latencies, n, 50);
+    unsigned long p99 = percentile(latencies, n, 99);
+    printf("    %-8s %5u calls, p50 %6lu us, p99 %6lu us, max %6lu us\n", name, n, p50, p99, n ? latencies[n - 1] : 0);
+}
+
+int main(){
+    for(unsigned int i = 0; i < WRITE_SIZE; i ++) data[i] = rand();
+    const char* names[] = {"single", "striped", "ping-pong", "mirrored", "concatenated"};
+    int pins[2] = {1, 2};
+    printf("%u files of %u bytes in %u byte writes\n", FILE_COUNT, FILE_SIZE, WRITE_SIZE);
+    for(int m = FLASH_STORAGE_ARRAY_SINGLE; m <= FLASH_STORAGE_ARRAY_CONCATENATED; m ++){
+        FlashStorageArrayMode mode = (FlashStorageArrayMode)m;
+        unsigned int device_count = (mode == FLASH_STORAGE_ARRAY_SINGLE) ? 1 : 2;
+        simReset(pins, device_count);
+        FlashStorage fs;
+        fs.init(pins, device_count, mode);
+        fs.initializeFAT();
+        fs.setTrace(ring, sizeof(ring));
+        unsigned long reads = fs.getStatusReads();
+        unsigned long bus_reads = sim_status_reads;
+        unsigned long programs = sim_program_count;
+        unsigned long erases = sim_erase_count;
+        unsigned long start = sim_time_us;
+        for(unsigned int f = 0; f < FILE_COUNT; f ++){
+            fs.newFile();
+            for(unsigned long written = 0; written < FILE_SIZE; written += WRITE_SIZE) fs.write(data, WRITE_SIZE);
+            fs.close();
+        }
+        unsigned long elapsed = sim_time_us - start;
+        reads = fs.getStatusReads() - reads;
+        bus_reads = sim_status_reads - bus_reads;
+        unsigned long busy_us = (sim_program_count - programs) * SIM_PROGRAM_US + (sim_erase_count - erases) * SIM_ERASE_US;
+        // openFile() closes the previous file as part of its own call, only the closes of the written files are traced
+        for(unsigned int f = 1; f <= FILE_COUNT; f ++){
+            fs.openFile(f);
+            while(fs.read(data, WRITE_SIZE) == WRITE_SIZE);
+        }
+        unsigned long program_us, erase_us;
+        fs.getOperationTimes(0, &program_us, &erase_us);
+        printf("%s: %lu us, %lu status reads waiting (%lu on the bus), %lu naive polls, learned tPP %lu us tSE %lu us\n",
+            names[m], elapsed, reads, bus_reads, busy_us / SIM_STATUS_READ_US, program_us, erase_us);
+        printLatency(&fs, "write", FLASH_STORAGE_TRACE_WRITE);
+        printLatency(&fs, "close", FLASH_STORAGE_TRACE_CLOSE);
+        printLatency(&fs, "newFile", FLASH_STORAGE_TRACE_NEW_FILE);
+        printLatency(&fs, "read", FLASH_STORAGE_TRACE_READ);
+    }
+    return 0;
+}
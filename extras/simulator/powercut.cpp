@@ -0,0 +1,183 @@
+/**
+ * @file powercut.cpp
+ * @brief power-cut harness, cuts the power at every erase and page program of a scripted workload
+ *
+ * For each array mode the workload is run once per cut point, each time with the power cut one operation later, until
+ * it completes. After every cut the volume is mounted again and checked:
+ *     init() succeeds and the file written before the workload is intact
+ *     every file in the FAT reads back as a prefix of the data written to it
+ *     every file is at least as long as the data made durable before the cut (by close(), sync() or writeFile()), and
+ *     the file saved by emergencyFlush() is exactly as long as it reported
+ *     a KV record set before the cut is still there
+ *     the volume takes a new file and mounts again afterwards
+ * The run that completes without a cut is checked the same way. The worst recovery time (getRecoveryTime()) over all cut
+ * points is reported per mode.
+ */
+#include "FlashStorage.hpp"
+#include "FlashKVStore.hpp"
+
+#define DATA_SIZE 40000
+#define KV_UNITS 2
+#define KV_KEY 7
+#define MAX_FILES 4
+
+/**
+ * @brief what the workload made durable before the cut
+ */
+struct Durable{
+    bool kv; // the KV record was set
+    unsigned int files; // files that must be in the FAT
+    unsigned long length[MAX_FILES + 1]; // shortest length of each of them, by file index
+    unsigned int exact_file; // file whose length must match exactly, 0 for none
+};
+
+static byte data[DATA_SIZE];
+static byte check[DATA_SIZE];
+
+static bool failed(long cut, const char* what, unsigned long value){
+    printf("FAIL: cut %ld: %s (%lu)\n", cut, what, value);
+    return false;
+}
+
+/**
+ * @brief run the workload once with the power cut after cut operations
+ *
+ * @return true once the workload completes without reaching the cut
+ */
+static void setDurable(Durable* durable, unsigned int file, unsigned long length){
+    durable->files = file;
+    durable->length[file] = length;
+}
+
+static bool runWorkload(int* pins, unsigned int device_count, FlashStorageArrayMode mode, long cut, Durable* durable){
+    // fresh chips, formatted with one closed file
+    for(unsigned int d = 0; d < device_count; d ++){
+        if(sim_mem[pins[d]]) memset(sim_mem[pins[d]], 0xAB, SIM_DEVICE_SIZE);
+        sim_busy_until[pins[d]] = 0;
+    }
+    FlashStorage fs;
+    fs.init(pins, device_count, mode);
+    fs.initializeFAT();
+    fs.newFile();
+    fs.write(data, 5000);
+    fs.close();
+    byte value[4] = {1, 2, 3, 4};
+    FlashKVStore kv;
+    // updated as each call returns, it survives the longjmp as it is not a local
+    memset(durable, 0, sizeof(Durable));
+    setDurable(durable, 1, 5000);
+    sim_cut_after = cut;
+    if(setjmp(sim_cut_jmp) != 0) return false;
+    fs.newFile();
+    fs.write(data, 3000);
+    fs.close();
+    setDurable(durable, 2, 3000);
+    fs.newFile();
+    fs.write(data, 9000);
+    fs.sync();
+    setDurable(durable, 3, 9000);
+    fs.write(&data[9000], 6000);
+    fs.close();
+    setDurable(durable, 3, 15000);
+    // the deletion can reach the chip before the call returns
+    setDurable(durable, 2, 3000);
+    fs.deleteLastFile();
+    fs.writeFile(data, 40);
+    setDurable(durable, 3, 40);
+    // a file left open next to the KV store
+    fs.newFile();
+    fs.write(data, 2000);
+    kv.init(&fs, KV_UNITS);
+    kv.set(KV_KEY, value, sizeof(value));
+    durable->kv = true;
+    fs.write(&data[2000], 3000);
+    fs.emergencyFlush();
+    // the length it saved is in the FAT kept in RAM
+    FlashStorageFAT fat;
+    fs.getFAT(&fat);
+    setDurable(durable, 4, fat.files[3].end_addr - fat.files[3].start_addr);
+    durable->exact_file = 4;
+    sim_cut_after = 0;
+    return true;
+}
+
+/**
+ * @brief mount the volume left by a cut and check it
+ */
+static bool checkVolume(int* pins, unsigned int device_count, FlashStorageArrayMode mode, long cut, Durable* durable,
+    unsigned long* recovery){
+    for(unsigned int d = 0; d < device_count; d ++) sim_busy_until[pins[d]] = 0;
+    FlashStorage fs;
+    FlashStorage_status_t status = fs.init(pins, device_count, mode);
+    if(status != FLASH_STORAGE_OK) return failed(cut, "init", status);
+    *recovery = fs.getRecoveryTime();
+    FlashStorageFAT fat;
+    fs.getFAT(&fat);
+    if(fat.file_count < durable->files) return failed(cut, "files lost", fat.file_count);
+    for(unsigned int f = 1; f <= fat.file_count; f ++){
+        fs.openFile(f);
+        unsigned int length = fs.read(check, DATA_SIZE);
+        fs.close();
+        if(memcmp(check, data, length) != 0) return failed(cut, "file data mismatch", f);
+        if(f == 1 && length != 5000) return failed(cut, "first file length", length);
+        if(f > durable->files) continue;
+        if(length < durable->length[f]) return failed(cut, "durable data lost", f);
+        if(f == durable->exact_file && length != durable->length[f]) return failed(cut, "emergencyFlush length", length);
+    }
+    // the KV store is reserved again after every mount
+    FlashKVStore kv;
+    status = kv.init(&fs, KV_UNITS);
+    if(status != FLASH_STORAGE_OK) return failed(cut, "kv init", status);
+    if(durable->kv){
+        byte value[4];
+        unsigned int length = sizeof(value);
+        status = kv.get(KV_KEY, value, &length);
+        if(status != FLASH_STORAGE_OK || length != 4 || value[3] != 4) return failed(cut, "kv record lost", status);
+    }
+    // still usable
+    if(fs.newFile() != FLASH_STORAGE_OK) return failed(cut, "new file after recovery", 0);
+    fs.write(data, 1000);
+    if(fs.close() != FLASH_STORAGE_OK) return failed(cut, "close after recovery", 0);
+    FlashStorage again;
+    status = again.init(pins, device_count, mode);
+    if(status != FLASH_STORAGE_OK) return failed(cut, "second mount", status);
+    return true;
+}
+
+int main(){
+    setvbuf(stdout, NULL, _IONBF, 0);
+    for(unsigned int i = 0; i < DATA_SIZE; i ++) data[i] = rand() | 1;
+    const char* names[] = {"single", "striped", "ping-pong", "mirrored", "concatenated"};
+    int pins[2] = {1, 2};
+    int result = 0;
+    for(int m = FLASH_STORAGE_ARRAY_SINGLE; m <= FLASH_STORAGE_ARRAY_CONCATENATED; m ++){
+        FlashStorageArrayMode mode = (FlashStorageArrayMode)m;
+        unsigned int device_count = (mode == FLASH_STORAGE_ARRAY_SINGLE) ? 1 : 2;
+        unsigned long worst = 0;
+        long worst_cut = 0;
+        long cut = 1;
+        bool ok = true;
+        for(; ; cut ++){
+            Durable durable;
+            // the run that completes is checked too, cut 0 in the report
+            bool completed = runWorkload(pins, device_count, mode, cut, &durable);
+            unsigned long recovery = 0;
+            if(!checkVolume(pins, device_count, mode, completed ? 0 : cut, &durable, &recovery)){
+                ok = false;
+                break;
+            }
+            if(completed) break;
+            if(recovery > worst){
+                worst = recovery;
+                worst_cut = cut;
+            }
+        }
+        if(!ok){
+            printf("%s: FAILED\n", names[m]);
+            result = 1;
+            continue;
+        }
+        printf("%s: %ld cut points ok, worst recovery %lu us (cut %ld)\n", names[m], cut - 1, worst, worst_cut);
+    }
+    return result;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file replay.cpp
+ * @brief replays a recorded trace on the simulated array and compares the call latencies with the recording
+ *
+ * The trace is read from a file in the format of tools.hpp, e.g. dumped from getTraceRecord() on the target. Without a
+ * file (or with -) the sample logging workload of tools.hpp is recorded first. The replay starts from a freshly formatted volume and
+ * is traced itself, for every call type the recorded and the replayed p50/p99/max latency are printed.
+ *
+ * usage: replay [trace file or -] [array mode 0-4]
+ */
+#include "tools.hpp"
+
+static FlashStorageTraceRecord recorded[TOOLS_MAX_RECORDS];
+static FlashStorageTraceRecord replayed[TOOLS_MAX_RECORDS];
+static byte ring[TOOLS_MAX_RECORDS * FLASH_STORAGE_TRACE_RECORD_SIZE];
+static byte data[4096];
+static unsigned long latencies[TOOLS_MAX_RECORDS];
+
+static const char* opName(unsigned int op){
+    const char* names[] = {"?", "newFile", "write", "close", "openFile", "read", "sync", "writeFile", "openForAppend",
+        "reserve", "reserve (background)", "poll", "emergencyFlush", "deleteLastFile", "deleteAllFiles", "initializeFAT",
+        "mountPartition", "reserveRegion"};
+    return op < sizeof(names) / sizeof(names[0]) ? names[op] : "?";
+}
+
+/**
+ * @brief print p50/p99/max of the calls of one type
+ */
+static void printLatency(FlashStorageTraceRecord* records, unsigned int count, unsigned int op){
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < count; i ++){
+        if(records[i].op == op) latencies[n ++] = records[i].duration_us;
+    }
+    unsigned long p50 = percentile(latencies, n, 50);
+    unsigned long p99 = percentile(latencies, n, 99);
+    printf("%6u calls, p50 %6lu us, p99 %6lu us, max %6lu us", n, p50, p99, n ? latencies[n - 1] : 0);
+}
+
+int main(int argc, char** argv){
+    unsigned int count;
+    if(argc > 1 && strcmp(argv[1], "-") != 0){
+        count = readTrace(argv[1], recorded, TOOLS_MAX_RECORDS);
+        if(count == 0){
+            printf("no records in %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else count = recordSample(recorded, TOOLS_MAX_RECORDS);
+    FlashStorageArrayMode mode = (argc > 2) ? (FlashStorageArrayMode)atoi(argv[2]) : FLASH_STORAGE_ARRAY_SINGLE;
+    unsigned int device_count = (mode == FLASH_STORAGE_ARRAY_SINGLE) ? 1 : 2;
+    int pins[2] = {1, 2};
+    simReset(pins, device_count);
+    FlashStorage fs;
+    fs.init(pins, device_count, mode);
+    fs.initializeFAT();
+    fs.setTrace(ring, sizeof(ring));
+    FlashStorage_status_t status = fs.replayTrace(recorded, count, data, sizeof(data));
+    unsigned int replayed_count = fs.getTraceCount();
+    for(unsigned int i = 0; i < replayed_count; i ++) fs.getTraceRecord(i, &replayed[i]);
+    unsigned long span = recorded[count - 1].start_us + recorded[count - 1].duration_us - recorded[0].start_us;
+    unsigned long replay_span = 0;
+    if(replayed_count > 0){
+        replay_span = replayed[replayed_count - 1].start_us + replayed[replayed_count - 1].duration_us - replayed[0].start_us;
+    }
+    printf("%u records over %lu us replayed in %lu us, status %d\n", count, span, replay_span, status);
+    for(unsigned int op = FLASH_STORAGE_TRACE_NEW_FILE; op <= FLASH_STORAGE_TRACE_RESERVE_REGION; op ++){
+        bool used = false;
+        for(unsigned int i = 0; i < count && !used; i ++) used = recorded[i].op == op;
+        if(!used) continue;
+        printf("%s\n    recorded: ", opName(op));
+        printLatency(recorded, count, op);
+        printf("\n    replayed: ");
+        printLatency(replayed, replayed_count, op);
+        printf("\n");
+    }
+    return status == FLASH_STORAGE_OK ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+/**
+ * @file sim.cpp
+ * @brief state of the simulated flash chips and the virtual clock
+ */
+#include "lib/W25Q64/W25Q64.hpp"
+
+unsigned long sim_time_us = 0; 
+SimSerial Serial; 
+byte* sim_mem[SIM_MAX_DEVICES]; 
+unsigned long sim_busy_until[SIM_MAX_DEVICES]; 
+unsigned long sim_status_reads = 0; 
+unsigned long sim_program_count = 0; 
+unsigned long sim_erase_count = 0; 
+long sim_cut_after = 0; 
+jmp_buf sim_cut_jmp; 
+
+void simFail(const char* what, int cs, unsigned long addr){
+    printf("FAIL: %s, device %d at 0x%lx\n", what, cs, addr); 
+    exit(1); 
+}
@@ -0,0 +1,103 @@
+/**
+ * @file tools.hpp
+ * @brief helpers shared by the simulator tools: fresh chips, trace files and latency percentiles
+ *
+ * A trace file holds one FlashStorageTraceRecord per line, as returned by getTraceRecord():
+ *     op arg start_us duration_us
+ * Empty lines and lines starting with # are skipped. On the target it can be printed over Serial with
+ *     for(unsigned int i = 0; i < fs.getTraceCount(); i ++){
+ *         FlashStorageTraceRecord record;
+ *         fs.getTraceRecord(i, &record);
+ *         Serial.print(record.op); Serial.print(' '); Serial.print(record.arg); Serial.print(' ');
+ *         Serial.print(record.start_us); Serial.print(' '); Serial.println(record.duration_us);
+ *     }
+ */
+#pragma once
+#include "FlashStorage.hpp"
+#include <algorithm>
+
+#define TOOLS_MAX_RECORDS 100000
+#define TOOLS_SAMPLE_WRITE 48
+
+/**
+ * @brief give the devices fresh chips, neither erased nor programmed, and no pending operation
+ */
+inline void simReset(int* pins, unsigned int device_count){
+    for(unsigned int d = 0; d < device_count; d ++){
+        if(sim_mem[pins[d]]) memset(sim_mem[pins[d]], 0xAB, SIM_DEVICE_SIZE);
+        sim_busy_until[pins[d]] = 0;
+    }
+}
+
+/**
+ * @brief read a trace file
+ *
+ * @return unsigned int records read, 0 if the file can't be opened or holds no record
+ */
+inline unsigned int readTrace(const char* path, FlashStorageTraceRecord* records, unsigned int max_records){
+    FILE* file = fopen(path, "r");
+    if(file == NULL) return 0;
+    char line[128];
+    unsigned int count = 0;
+    while(count < max_records && fgets(line, sizeof(line), file) != NULL){
+        unsigned int op;
+        if(line[0] == '#' || sscanf(line, "%u %lu %lu %lu", &op, &records[count].arg, &records[count].start_us,
+            &records[count].duration_us) != 4) continue;
+        records[count].op = (FlashStorageTraceOp)op;
+        count ++;
+    }
+    fclose(file);
+    return count;
+}
+
+/**
+ * @brief record a sample logging workload on a single simulated chip
+ *
+ * A sensor log written in small pieces every 2 ms with a sync every 100 writes, a config file written in one call and
+ * the log read back, spaced like a sketch would call the library.
+ *
+ * @return unsigned int records
+ */
+inline unsigned int recordSample(FlashStorageTraceRecord* records, unsigned int max_records){
+    static byte ring[TOOLS_MAX_RECORDS * FLASH_STORAGE_TRACE_RECORD_SIZE];
+    static byte data[512];
+    int pins[1] = {1};
+    simReset(pins, 1);
+    FlashStorage fs;
+    fs.init(pins, 1, FLASH_STORAGE_ARRAY_SINGLE);
+    fs.setTrace(ring, sizeof(ring));
+    fs.initializeFAT();
+    fs.writeFile(data, 40);
+    fs.newFile();
+    fs.reserve(0x8000, false);
+    for(unsigned int i = 0; i < 3000; i ++){
+        unsigned long next = sim_time_us + 2000;
+        fs.write(data, TOOLS_SAMPLE_WRITE);
+        if(i % 100 == 99) fs.sync();
+        if(i < 100) fs.poll();
+        if(sim_time_us < next) sim_time_us = next;
+    }
+    fs.close();
+    fs.openFile(2);
+    while(fs.read(data, sizeof(data)) == sizeof(data)) sim_time_us += 500;
+    fs.close();
+    unsigned int count = fs.getTraceCount();
+    if(count > max_records) count = max_records;
+    for(unsigned int i = 0; i < count; i ++) fs.getTraceRecord(i, &records[i]);
+    return count;
+}
+
+/**
+ * @brief get a percentile of a set of latencies
+ *
+ * @param values latencies, sorted in place
+ * @param pct percentile, 0 to 100
+ * @return unsigned long the value below which pct percent of the values fall, 0 for an empty set
+ */
+inline unsigned long percentile(unsigned long* values, unsigned int count, unsigned int pct){
+    if(count == 0) return 0;
+    std::sort(values, values + count);
+    unsigned int index = (unsigned long)count * pct / 100;
+    if(index >= count) index = count - 1;
+    return values[index];
+}